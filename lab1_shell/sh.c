@@ -1,20 +1,29 @@
-#include "list.h"
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <poll.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define PERM (0644)   /* default permission rw-r--r-- */
-#define MAXBUF (512)  /* max length of input line. */
-#define MAX_ARG (100) /* max number of cmd line arguments. */
+#define MAXBUF (512)  /* size of small line buffers. */
+#define READ_CHUNK (65536) /* min free space for a read of input. */
+#define ARENA_BLOCK (4096) /* min size of an arena block. */
+#define HASH_SIZE (256) /* buckets in the command hash, a power of two. */
+#define REAP_RING (4096) /* reaped children not yet seen by the main loop. */
 
 typedef enum {
   AMPERSAND, /* & */
@@ -27,171 +36,1813 @@ typedef enum {
 } token_type_t;
 
 static char *progname;             /* name of this shell program. */
-static char input_buf[MAXBUF];     /* input is placed here. */
-static char token_buf[2 * MAXBUF]; /* tokens are placed here. */
+static char *read_buf;             /* input is placed here. */
+static size_t read_size;           /* allocated size of read_buf. */
+static size_t read_start;          /* first character not yet fetched. */
+static size_t read_end;            /* end of the input in read_buf. */
+static int script_fd;              /* commands are read from here. */
 static char *input_char;           /* next character to check. */
-static char *token;                /* a token such as /bin/ls */
+static char pending;               /* character replaced by a token's 0. */
+
+/* arena: memory for one line, freed all at once when the next line is
+ * parsed. After the first few lines it is a single block that is reused,
+ * so parsing does no malloc or free. */
+typedef struct arena_block_t arena_block_t;
+
+struct arena_block_t {
+  arena_block_t *next;
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+static arena_block_t *arena; /* current block first. */
+
+static char **path_dirs;      /* directories in PATH. */
+static int npath_dirs;        /* entries in path_dirs. */
+static char *path_value;      /* PATH that path_dirs was made from. */
+static char *path_buf;        /* path_value split at ':'. */
+static int input_fd;          /* for i/o redirection or pipe. */
+static int output_fd;         /* for i/o redirection or pipe */
+static bool use_fork;         /* launch with fork instead of posix_spawn. */
+static int pipe_size;         /* F_SETPIPE_SZ for new pipes, 0 for default. */
+static bool interactive;      /* stdin is a terminal: do job control. */
+static pid_t shell_pgid;      /* process group of the shell itself. */
+static sigset_t job_signals;  /* ignored by an interactive shell. */
+
+/* command hash: remembers where in PATH each command was found. */
+typedef struct hash_entry_t hash_entry_t;
+
+struct hash_entry_t {
+  hash_entry_t *next;
+  char *name;
+  char *path;
+  unsigned hits;
+};
+
+static hash_entry_t *command_hash[HASH_SIZE];
+
+/* job table: every pipeline is a job until all its stages are done. */
+typedef struct {
+  pid_t pid;
+  int status;            /* from wait4, valid when done. */
+  bool done;
+  bool stopped;
+  struct rusage ru;      /* from wait4, valid when done. */
+  struct timespec start; /* when it was started. */
+  struct timespec end;   /* when it was reaped. */
+  char *cmd;             /* this stage only. */
+} proc_t;
+
+typedef struct {
+  int id;         /* job number, as in %1. */
+  pid_t pgid;     /* process group, the pid of the first stage. */
+  proc_t *procs;  /* one per started stage. */
+  int nprocs;
+  int max_procs;
+  char *cmd;      /* command line shown by jobs. */
+  bool background;
+  bool timed;     /* started with the time prefix. */
+  struct timespec start; /* the time prefix, else the first stage's start. */
+} job_t;
+
+/* parallel builtin: one slot per running command. */
+typedef struct {
+  proc_t proc;    /* pid 0 if the slot is free. */
+  long seq;       /* input line number. */
+  char *cmd;      /* the line, for reporting. */
+  int out_fd;     /* output pipe from the command, or -1. */
+  char *out;      /* output collected so far. */
+  size_t out_len;
+  size_t out_size;
+  bool finished;  /* -k: done, waiting for the ones before it. */
+} slot_t;
+
+static slot_t *par_slots;    /* parallel -j N: N entries. */
+static int npar_slots;
+static bool in_parallel;     /* children stay in the shell's group. */
+
+static job_t **job_table;    /* job id - 1 is the index, NULL if free. */
+static int max_jobs;         /* allocated entries in job_table. */
+static job_t *current_job;   /* pipeline being started. */
+static bool launching;       /* SIGCHLD is blocked while it is started. */
+static sigset_t launch_mask; /* signal mask to restore afterwards. */
+
+/* Filled by the SIGCHLD handler, emptied by update_jobs. */
+static struct {
+  pid_t pid;
+  int status;
+  struct rusage ru;
+  struct timespec end;
+} reap_ring[REAP_RING];
+static volatile unsigned reap_head; /* next entry for update_jobs. */
+static volatile unsigned reap_tail; /* next entry for the handler. */
+static bool jobs_changed;           /* update_jobs changed a job. */
+
+static bool time_next;             /* the pipeline being started is timed. */
+static struct timespec time_start; /* when its time prefix was read. */
+static int log_fd = -1;            /* -l file: every job as a JSON line. */
+
+extern char **environ;
+
+void error(char *fmt, ...);
+
+static void *xrealloc(void *p, size_t size) {
+  p = realloc(p, size);
+
+  if (p == NULL) {
+    error("out of memory.");
+    exit(1);
+  }
+
+  return p;
+}
+
+/* fetch_line: make input_char point to the next line of input, which ends
+ * with a newline. Input is read in large blocks and lines are found in
+ * place, so a line may be of any length. */
+int fetch_line(char *prompt) {
+  char *newline;
+  size_t len;
+  ssize_t n;
+
+  printf("%s", prompt);
+  fflush(stdout);
+
+  for (;;) {
+    newline = memchr(read_buf + read_start, '\n', read_end - read_start);
+    if (newline != NULL)
+      break;
+
+    /* Move the partial line to the front and make room after it. The
+     * extra byte is for a newline after a last line without one. */
+    memmove(read_buf, read_buf + read_start, read_end - read_start);
+    read_end -= read_start;
+    read_start = 0;
+
+    if (read_size - read_end < READ_CHUNK + 1) {
+      read_size = read_size ? 2 * read_size : 2 * READ_CHUNK;
+      read_buf = xrealloc(read_buf, read_size);
+    }
+
+    n = read(script_fd, read_buf + read_end, read_size - read_end - 1);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    if (n <= 0) {
+      if (read_end == 0)
+        return EOF;
+      read_buf[read_end++] = '\n';
+    } else
+      read_end += n;
+  }
+
+  input_char = read_buf + read_start;
+  len = newline + 1 - input_char;
+  read_start += len;
+  pending = 0;
+
+  return len;
+}
+
+/* arena_alloc: size bytes that stay valid until arena_reset. */
+static void *arena_alloc(size_t size) {
+  arena_block_t *b;
+  size_t n;
+
+  size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+  if (arena == NULL || arena->size - arena->used < size) {
+    n = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+    if (arena != NULL && n < 2 * arena->size)
+      n = 2 * arena->size;
+    b = xrealloc(NULL, sizeof *b + n);
+    b->next = arena;
+    b->size = n;
+    b->used = 0;
+    arena = b;
+  }
+
+  arena->used += size;
+
+  return arena->data + arena->used - size;
+}
+
+/* arena_reset: free everything, keeping one block as large as all of
+ * them together. */
+static void arena_reset(void) {
+  arena_block_t *b;
+  size_t total;
+
+  if (arena == NULL)
+    return;
+
+  if (arena->next != NULL) {
+    total = 0;
+    while ((b = arena) != NULL) {
+      total += b->size;
+      arena = b->next;
+      free(b);
+    }
+    arena = xrealloc(NULL, sizeof *arena + total);
+    arena->next = NULL;
+    arena->size = total;
+  }
+
+  arena->used = 0;
+}
+
+/* char_class: how the tokenizer treats each character. */
+enum { WORD, SPACE, DELIM };
+
+static const unsigned char char_class[256] = {
+    [0] = SPACE,    [' '] = SPACE, ['\t'] = SPACE, ['\n'] = DELIM,
+    [';'] = DELIM,  ['|'] = DELIM, ['&'] = DELIM,  ['<'] = DELIM,
+    ['>'] = DELIM,
+};
+
+/* gettoken: read one token and let *outptr point to it. Words are split
+ * in place: the character after a word becomes a 0, and if it was a
+ * delimiter it is kept in pending for the next call. */
+int gettoken(char **outptr) {
+  token_type_t type;
+  char c;
+
+  if (pending != 0) {
+    c = pending;
+    pending = 0;
+  } else {
+    while (char_class[(unsigned char)*input_char] == SPACE)
+      input_char++;
+    c = *input_char;
+  }
+
+  switch (c) {
+  case '\n':
+    *outptr = "\n";
+    type = NEWLINE;
+    break;
+
+  case '<':
+    *outptr = "<";
+    type = INPUT;
+    break;
+
+  case '>':
+    *outptr = ">";
+    type = OUTPUT;
+    break;
+
+  case '&':
+    *outptr = "&";
+    type = AMPERSAND;
+    break;
+
+  case '|':
+    *outptr = "|";
+    type = PIPE;
+    break;
+
+  case ';':
+    *outptr = ";";
+    type = SEMICOLON;
+    break;
+
+  default:
+    *outptr = input_char;
+
+    while (char_class[(unsigned char)*input_char] == WORD)
+      input_char++;
+
+    c = *input_char;
+    *input_char = 0; /* null-terminate the string. */
+
+    if (char_class[(unsigned char)c] == DELIM)
+      pending = c;
+    else
+      input_char++;
+
+    return NORMAL;
+  }
+
+  input_char++;
+
+  return type;
+}
+
+/* error: print error message using formatting string similar to printf. */
+void error(char *fmt, ...) {
+  va_list ap;
+
+  fprintf(stderr, "%s: error: ", progname);
+
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+
+  /* print system error code if errno is not zero. */
+  if (errno != 0) {
+    fprintf(stderr, ": ");
+    perror(0);
+  } else
+    fputc('\n', stderr);
+}
+
+static unsigned hash_string(const char *s) {
+  unsigned h = 5381;
+
+  while (*s)
+    h = h * 33 + (unsigned char)*s++;
+
+  return h & (HASH_SIZE - 1);
+}
+
+/* hash_clear: forget all remembered commands. */
+static void hash_clear(void) {
+  hash_entry_t *e;
+  int i;
+
+  for (i = 0; i < HASH_SIZE; ++i) {
+    while ((e = command_hash[i]) != NULL) {
+      command_hash[i] = e->next;
+      free(e->name);
+      free(e->path);
+      free(e);
+    }
+  }
+}
+
+/* hash_forget: drop name, e.g. after its program disappeared. */
+static void hash_forget(char *name) {
+  hash_entry_t **p;
+  hash_entry_t *e;
+
+  for (p = &command_hash[hash_string(name)]; (e = *p) != NULL; p = &e->next) {
+    if (!strcmp(e->name, name)) {
+      *p = e->next;
+      free(e->name);
+      free(e->path);
+      free(e);
+      return;
+    }
+  }
+}
+
+/* init_search_path: make an array of directories to look for programs in. */
+static void init_search_path(void) {
+  char *path;
+  char *s;
+  int n;
+
+  path = getenv("PATH");
+  if (path == NULL)
+    path = "";
+
+  free(path_value);
+  free(path_buf);
+  free(path_dirs);
+  hash_clear();
+
+  /* path may look like "/bin:/usr/bin:/usr/local/bin" and path_dirs then
+   * points at "/bin" "/usr/bin" "/usr/local/bin" in path_buf. An empty
+   * entry means the current directory. */
+  path_value = strdup(path);
+  path_buf = strdup(path);
+  if (path_value == NULL || path_buf == NULL) {
+    error("out of memory.");
+    exit(1);
+  }
+
+  n = 1;
+  for (s = path_buf; *s != 0; ++s)
+    n += *s == ':';
+
+  path_dirs = malloc(n * sizeof path_dirs[0]);
+  if (path_dirs == NULL) {
+    error("out of memory.");
+    exit(1);
+  }
+
+  npath_dirs = 0;
+  s = path_buf;
+
+  for (;;) {
+    path_dirs[npath_dirs++] = *s == ':' || *s == 0 ? "." : s;
+    s = strchr(s, ':');
+    if (s == NULL)
+      break;
+    *s++ = 0;
+  }
+}
+
+/* find_program: full path of the command name, or NULL if not found. The
+ * result is valid until the command hash is cleared. */
+static char *find_program(char *name) {
+  char path[PATH_MAX];
+  hash_entry_t *e;
+  unsigned h;
+  int i;
+
+  if (strchr(name, '/') != NULL)
+    return name;
+
+  /* PATH is only changed by export, but a cheap check keeps it honest. */
+  if (strcmp(getenv("PATH") ? getenv("PATH") : "", path_value) != 0)
+    init_search_path();
+
+  h = hash_string(name);
+
+  for (e = command_hash[h]; e != NULL; e = e->next) {
+    if (!strcmp(e->name, name)) {
+      e->hits += 1;
+      return e->path;
+    }
+  }
+
+  for (i = 0; i < npath_dirs; ++i) {
+    snprintf(path, sizeof path, "%s/%s", path_dirs[i], name);
+    if (access(path, X_OK) == 0)
+      break;
+  }
+
+  if (i == npath_dirs)
+    return NULL;
+
+  e = malloc(sizeof *e);
+  if (e == NULL || (e->name = strdup(name)) == NULL ||
+      (e->path = strdup(path)) == NULL) {
+    error("out of memory.");
+    exit(1);
+  }
+
+  e->hits = 1;
+  e->next = command_hash[h];
+  command_hash[h] = e;
+
+  return e->path;
+}
+
+/* spawn_program: start path with posix_spawn, which does not copy the
+ * page tables of the shell. Returns the pid, or -1 with errno set. */
+static pid_t spawn_program(char *path, char **argv) {
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t empty;
+  pid_t pid;
+  int err;
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawnattr_init(&attr);
+
+  /* The child starts with the default signal handling, an empty mask,
+   * and with job control in the process group of its job. */
+  sigemptyset(&empty);
+  posix_spawnattr_setsigmask(&attr, &empty);
+  posix_spawnattr_setsigdefault(&attr, &job_signals);
+
+  if (interactive && !in_parallel) {
+    posix_spawnattr_setpgroup(&attr, current_job ? current_job->pgid : 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+                                        POSIX_SPAWN_SETSIGDEF |
+                                        POSIX_SPAWN_SETPGROUP);
+  } else
+    posix_spawnattr_setflags(&attr,
+                             POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+  if (input_fd != 0) {
+    posix_spawn_file_actions_adddup2(&actions, input_fd, 0);
+    posix_spawn_file_actions_addclose(&actions, input_fd);
+  }
+
+  if (output_fd != 0) {
+    posix_spawn_file_actions_adddup2(&actions, output_fd, 1);
+    posix_spawn_file_actions_addclose(&actions, output_fd);
+  }
+
+  err = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+
+  return pid;
+}
+
+/* fork_child: fork and set the child up like spawn_program does. Returns
+ * as fork does. Slower than spawn_program, but the child can do anything,
+ * e.g. run a builtin in a pipeline. */
+static pid_t fork_child(void) {
+  struct sigaction sa;
+  sigset_t empty;
+  pid_t pgid;
+  pid_t pid;
+  int sig;
+
+  pgid = current_job ? current_job->pgid : 0;
+
+  pid = fork();
+
+  /* Both sides set the process group, whichever runs first wins. */
+  if (pid > 0 && interactive && !in_parallel)
+    setpgid(pid, pgid);
+
+  if (pid != 0)
+    return pid;
+
+  if (interactive && !in_parallel)
+    setpgid(0, pgid);
+
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = SIG_DFL;
+
+  for (sig = 1; sig < NSIG; ++sig)
+    if (sigismember(&job_signals, sig) == 1)
+      sigaction(sig, &sa, NULL);
+
+  sigemptyset(&empty);
+  sigprocmask(SIG_SETMASK, &empty, NULL);
+
+  if (input_fd != 0) {
+    dup2(input_fd, 0);
+    close(input_fd);
+  }
+
+  if (output_fd != 0) {
+    dup2(output_fd, 1);
+    close(output_fd);
+  }
+
+  return 0;
+}
+
+/* fork_program: start path with fork and execv. */
+static pid_t fork_program(char *path, char **argv) {
+  pid_t pid;
+
+  pid = fork_child();
+
+  if (pid != 0)
+    return pid;
+
+  execv(path, argv);
+
+  error("cannot execute %s", path);
+  _exit(127);
+}
+
+/* reap: move state changes of children into reap_ring. Called from the
+ * SIGCHLD handler and, with SIGCHLD blocked, from update_jobs. */
+static void reap(void) {
+  pid_t pid;
+  unsigned i;
+
+  while (reap_tail - reap_head < REAP_RING) {
+    i = reap_tail % REAP_RING;
+
+    pid = wait4(-1, &reap_ring[i].status, WNOHANG | WUNTRACED | WCONTINUED,
+                &reap_ring[i].ru);
+    if (pid <= 0)
+      break;
+
+    clock_gettime(CLOCK_MONOTONIC, &reap_ring[i].end);
+    reap_ring[i].pid = pid;
+    reap_tail += 1;
+  }
+}
+
+static void sigchld_handler(int sig) {
+  int saved_errno = errno;
+
+  reap();
+  errno = saved_errno;
+}
+
+static void block_sigchld(sigset_t *old) {
+  sigset_t set;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &set, old);
+}
+
+static proc_t *find_proc(pid_t pid) {
+  job_t *job;
+  int i, k;
+
+  for (i = 0; i < npar_slots; ++i)
+    if (par_slots[i].proc.pid == pid)
+      return &par_slots[i].proc;
+
+  for (i = 0; i < max_jobs; ++i) {
+    job = job_table[i];
+    if (job == NULL)
+      continue;
+    for (k = 0; k < job->nprocs; ++k)
+      if (job->procs[k].pid == pid)
+        return &job->procs[k];
+  }
+
+  return NULL;
+}
+
+/* update_jobs: apply what the handler reaped to the job table. SIGCHLD
+ * must be blocked. */
+static void update_jobs(void) {
+  proc_t *proc;
+  unsigned i;
+  int status;
+
+  for (;;) {
+    /* Catches up if the ring was full when the handler ran. */
+    reap();
+
+    if (reap_head == reap_tail)
+      return;
+
+    while (reap_head != reap_tail) {
+      i = reap_head % REAP_RING;
+      status = reap_ring[i].status;
+      proc = find_proc(reap_ring[i].pid);
+      reap_head += 1;
+
+      if (proc == NULL)
+        continue;
+
+      jobs_changed = true;
+
+      if (WIFSTOPPED(status))
+        proc->stopped = true;
+      else if (WIFCONTINUED(status))
+        proc->stopped = false;
+      else {
+        proc->done = true;
+        proc->status = status;
+        proc->ru = reap_ring[i].ru;
+        proc->end = reap_ring[i].end;
+      }
+    }
+  }
+}
+
+static bool job_running(job_t *job) {
+  int i;
+
+  for (i = 0; i < job->nprocs; ++i)
+    if (!job->procs[i].done && !job->procs[i].stopped)
+      return true;
+
+  return false;
+}
+
+static bool job_done(job_t *job) {
+  int i;
+
+  for (i = 0; i < job->nprocs; ++i)
+    if (!job->procs[i].done)
+      return false;
+
+  return true;
+}
+
+static double seconds(struct timespec from, struct timespec to) {
+  return (to.tv_sec - from.tv_sec) + (to.tv_nsec - from.tv_nsec) * 1e-9;
+}
+
+static double tv_seconds(struct timeval tv) {
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/* exit_code: as $? would show it. */
+static int exit_code(int status) {
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/* json_string: s as a JSON string. */
+static void json_string(FILE *f, char *s) {
+  fputc('"', f);
+
+  for (; *s != 0; ++s) {
+    if (*s == '"' || *s == '\\')
+      fprintf(f, "\\%c", *s);
+    else if ((unsigned char)*s < ' ')
+      fprintf(f, "\\u%04x", *s);
+    else
+      fputc(*s, f);
+  }
+
+  fputc('"', f);
+}
+
+/* report_job: print a finished timed job as a table on stderr, and log
+ * every finished job with -l. */
+static void report_job(job_t *job) {
+  struct timespec end;
+  proc_t *p;
+  FILE *f;
+  int i;
+
+  end = job->start;
+  for (i = 0; i < job->nprocs; ++i)
+    if (seconds(end, job->procs[i].end) > 0)
+      end = job->procs[i].end;
+
+  if (job->timed) {
+    fprintf(stderr, "%-5s %-7s %4s %9s %9s %9s %9s %7s %7s  %s\n", "stage",
+            "pid", "exit", "real", "user", "sys", "maxrss", "vcsw", "ivcsw",
+            "command");
+
+    for (i = 0; i < job->nprocs; ++i) {
+      p = &job->procs[i];
+      fprintf(stderr, "%-5d %-7d %4d %8.3fs %8.3fs %8.3fs %7ldkB %7ld %7ld  %s\n",
+              i + 1, (int)p->pid, exit_code(p->status),
+              seconds(p->start, p->end), tv_seconds(p->ru.ru_utime),
+              tv_seconds(p->ru.ru_stime), p->ru.ru_maxrss, p->ru.ru_nvcsw,
+              p->ru.ru_nivcsw, p->cmd);
+    }
+
+    fprintf(stderr, "real %.3fs\n", seconds(job->start, end));
+  }
+
+  if (log_fd < 0)
+    return;
+
+  /* One write per line, so that shells sharing the log do not mix. */
+  f = fdopen(dup(log_fd), "w");
+  if (f == NULL)
+    return;
+
+  fprintf(f, "{\"cmd\":");
+  json_string(f, job->cmd);
+  fprintf(f, ",\"real\":%.6f,\"stages\":[", seconds(job->start, end));
+
+  for (i = 0; i < job->nprocs; ++i) {
+    p = &job->procs[i];
+    fprintf(f, "%s{\"pid\":%d,\"cmd\":", i ? "," : "", (int)p->pid);
+    json_string(f, p->cmd);
+    fprintf(f,
+            ",\"exit\":%d,\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,"
+            "\"maxrss_kb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld}",
+            exit_code(p->status), seconds(p->start, p->end),
+            tv_seconds(p->ru.ru_utime), tv_seconds(p->ru.ru_stime),
+            p->ru.ru_maxrss, p->ru.ru_nvcsw, p->ru.ru_nivcsw);
+  }
+
+  fprintf(f, "]}\n");
+  fclose(f);
+}
+
+/* free_job: forget a job, reporting it if it has finished. */
+static void free_job(job_t *job) {
+  int i;
+
+  if (job_done(job))
+    report_job(job);
+
+  for (i = 0; i < job->nprocs; ++i)
+    free(job->procs[i].cmd);
+
+  job_table[job->id - 1] = NULL;
+  free(job->procs);
+  free(job->cmd);
+  free(job);
+}
+
+/* add_stage: remember pid as a stage of the pipeline being started, which
+ * was launched at the time in launched. */
+static void add_stage(pid_t pid, char **argv, struct timespec *launched) {
+  proc_t *proc;
+  size_t start;
+  size_t len;
+  int i;
+
+  if (current_job == NULL) {
+    for (i = 0; i < max_jobs; ++i)
+      if (job_table[i] == NULL)
+        break;
+
+    if (i == max_jobs) {
+      max_jobs = max_jobs ? 2 * max_jobs : 16;
+      job_table = realloc(job_table, max_jobs * sizeof job_table[0]);
+      if (job_table == NULL) {
+        error("out of memory.");
+        exit(1);
+      }
+      memset(job_table + i, 0, (max_jobs - i) * sizeof job_table[0]);
+    }
+
+    current_job = calloc(1, sizeof *current_job);
+    if (current_job == NULL || (current_job->cmd = strdup("")) == NULL) {
+      error("out of memory.");
+      exit(1);
+    }
+
+    current_job->id = i + 1;
+    current_job->pgid = pid;
+    current_job->timed = time_next;
+    current_job->start = time_next ? time_start : *launched;
+    job_table[i] = current_job;
+  }
+
+  if (current_job->nprocs == current_job->max_procs) {
+    current_job->max_procs = current_job->max_procs ? 2 * current_job->max_procs : 4;
+    current_job->procs = realloc(current_job->procs,
+                                 current_job->max_procs * sizeof(proc_t));
+  }
+
+  len = strlen(current_job->cmd) + 4;
+  for (i = 0; argv[i] != NULL; ++i)
+    len += strlen(argv[i]) + 1;
+
+  current_job->cmd = realloc(current_job->cmd, len);
+
+  if (current_job->procs == NULL || current_job->cmd == NULL) {
+    error("out of memory.");
+    exit(1);
+  }
+
+  if (current_job->nprocs > 0)
+    strcat(current_job->cmd, " | ");
+
+  start = strlen(current_job->cmd);
+
+  for (i = 0; argv[i] != NULL; ++i) {
+    strcat(current_job->cmd, argv[i]);
+    if (argv[i + 1] != NULL)
+      strcat(current_job->cmd, " ");
+  }
+
+  proc = &current_job->procs[current_job->nprocs++];
+  memset(proc, 0, sizeof *proc);
+  proc->pid = pid;
+  proc->start = *launched;
+
+  /* This stage is the end of the job's command line. */
+  proc->cmd = strdup(current_job->cmd + start);
+  if (proc->cmd == NULL) {
+    error("out of memory.");
+    exit(1);
+  }
+}
+
+/* wait_job: sleep until no stage of job is running. A foreground job
+ * gets the terminal meanwhile. */
+static void wait_job(job_t *job, bool foreground) {
+  sigset_t old;
+  sigset_t wait_mask;
+
+  block_sigchld(&old);
+
+  /* SIGCHLD may already be blocked, e.g. by wait in a pipeline. */
+  wait_mask = old;
+  sigdelset(&wait_mask, SIGCHLD);
+
+  if (foreground && interactive)
+    tcsetpgrp(0, job->pgid);
+
+  for (;;) {
+    update_jobs();
+    if (!job_running(job))
+      break;
+    sigsuspend(&wait_mask);
+  }
+
+  if (foreground && interactive)
+    tcsetpgrp(0, shell_pgid);
+
+  sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+/* foreground_job: wait for job, which stays in the table if it stopped. */
+static void foreground_job(job_t *job) {
+  wait_job(job, true);
+
+  if (job_done(job))
+    free_job(job);
+  else {
+    job->background = true;
+    printf("\n[%d]+  Stopped\t\t%s\n", job->id, job->cmd);
+    fflush(stdout);
+  }
+}
+
+/* continue_job: send SIGCONT to every stage of a stopped job. */
+static void continue_job(job_t *job) {
+  int i;
+
+  for (i = 0; i < job->nprocs; ++i)
+    job->procs[i].stopped = false;
+
+  if (interactive)
+    kill(-job->pgid, SIGCONT);
+  else
+    for (i = 0; i < job->nprocs; ++i)
+      if (!job->procs[i].done)
+        kill(job->procs[i].pid, SIGCONT);
+}
+
+/* finish_pipeline: all stages have been started. */
+static void finish_pipeline(bool foreground) {
+  struct timespec end;
+  job_t *job;
+
+  job = current_job;
+  current_job = NULL;
+
+  if (launching) {
+    launching = false;
+    sigprocmask(SIG_SETMASK, &launch_mask, NULL);
+  }
+
+  /* Only builtins that ran in the shell. */
+  if (job == NULL && time_next) {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stderr, "real %.3fs (shell builtin)\n", seconds(time_start, end));
+  }
+
+  time_next = false;
+
+  if (job == NULL)
+    return;
+
+  if (foreground)
+    foreground_job(job);
+  else {
+    job->background = true;
+    if (interactive) {
+      printf("[%d] %d\n", job->id, (int)job->pgid);
+      fflush(stdout);
+    }
+  }
+}
+
+/* notify_jobs: report and forget background jobs that have finished. */
+static void notify_jobs(void) {
+  sigset_t old;
+  job_t *job;
+  int i;
+
+  /* Nothing reaped since last time: no system calls. */
+  if (reap_head == reap_tail && !jobs_changed)
+    return;
+
+  block_sigchld(&old);
+  update_jobs();
+  sigprocmask(SIG_SETMASK, &old, NULL);
+
+  jobs_changed = false;
+
+  for (i = 0; i < max_jobs; ++i) {
+    job = job_table[i];
+    if (job != NULL && job->background && job_done(job)) {
+      if (interactive)
+        printf("[%d]+  Done\t\t\t%s\n", job->id, job->cmd);
+      free_job(job);
+    }
+  }
+}
+
+/* find_job: job for %n or n, or the most recent job if spec is NULL. */
+static job_t *find_job(char *spec) {
+  int i;
+
+  if (spec == NULL) {
+    for (i = max_jobs - 1; i >= 0; --i)
+      if (job_table[i] != NULL)
+        return job_table[i];
+    errno = 0;
+    error("no current job");
+    return NULL;
+  }
+
+  i = atoi(spec[0] == '%' ? spec + 1 : spec);
+
+  if (i < 1 || i > max_jobs || job_table[i - 1] == NULL) {
+    errno = 0;
+    error("%s: no such job", spec);
+    return NULL;
+  }
+
+  return job_table[i - 1];
+}
+
+/* builtin_jobs: list jobs, forgetting those that are done. */
+static int builtin_jobs(char **argv, int argc, int out) {
+  sigset_t old;
+  job_t *job;
+  int i;
+
+  block_sigchld(&old);
+  update_jobs();
+  sigprocmask(SIG_SETMASK, &old, NULL);
+
+  for (i = 0; i < max_jobs; ++i) {
+    job = job_table[i];
+    if (job == NULL)
+      continue;
+
+    dprintf(out, "[%d]   %-24s%s\n", job->id,
+            job_done(job) ? "Done" : job_running(job) ? "Running" : "Stopped",
+            job->cmd);
+
+    if (job_done(job))
+      free_job(job);
+  }
+
+  return 0;
+}
 
-static list_t *path_dir_list; /* list of directories in PATH. */
-static int input_fd;          /* for i/o redirection or pipe. */
-static int output_fd;         /* for i/o redirection or pipe */
+/* builtin_fg: continue a job in the foreground. */
+static int builtin_fg(char **argv, int argc, int out) {
+  job_t *job;
 
-/* fetch_line: read one line from user and put it in input_buf. */
-int fetch_line(char *prompt) {
-  int c;
-  int count;
+  job = find_job(argc > 1 ? argv[1] : NULL);
+  if (job == NULL)
+    return 1;
 
-  input_char = input_buf;
-  token = token_buf;
+  dprintf(out, "%s\n", job->cmd);
 
-  printf("%s", prompt);
-  fflush(stdout);
+  job->background = false;
+  continue_job(job);
+  foreground_job(job);
+
+  return 0;
+}
 
-  count = 0;
+/* builtin_bg: continue a stopped job in the background. */
+static int builtin_bg(char **argv, int argc, int out) {
+  job_t *job;
 
-  for (;;) {
+  job = find_job(argc > 1 ? argv[1] : NULL);
+  if (job == NULL)
+    return 1;
+
+  dprintf(out, "[%d]+ %s &\n", job->id, job->cmd);
+
+  job->background = true;
+  continue_job(job);
+
+  return 0;
+}
+
+/* builtin_wait: wait for the given jobs, or all background jobs. */
+static int builtin_wait(char **argv, int argc, int out) {
+  job_t *job;
+  int i;
+
+  if (argc == 1) {
+    for (i = 0; i < max_jobs; ++i) {
+      job = job_table[i];
+      if (job != NULL && job->background) {
+        wait_job(job, false);
+        if (job_done(job))
+          free_job(job);
+      }
+    }
+    return 0;
+  }
+
+  for (i = 1; i < argc; ++i) {
+    job = find_job(argv[i]);
+    if (job == NULL)
+      return 1;
+    wait_job(job, false);
+    if (job_done(job))
+      free_job(job);
+  }
+
+  return 0;
+}
+
+/* builtin_hash: hash lists remembered commands, hash -r forgets them. */
+static int builtin_hash(char **argv, int argc, int out) {
+  hash_entry_t *e;
+  int i;
+
+  if (argc > 1 && !strcmp(argv[1], "-r")) {
+    hash_clear();
+    return 0;
+  }
+
+  dprintf(out, "hits\tcommand\n");
+
+  for (i = 0; i < HASH_SIZE; ++i)
+    for (e = command_hash[i]; e != NULL; e = e->next)
+      dprintf(out, "%4u\t%s\n", e->hits, e->path);
+
+  return 0;
+}
 
-    c = getchar();
+/* builtin_cd: cd [dir], cd - goes back and prints where. */
+static int builtin_cd(char **argv, int argc, int out) {
+  char old[PATH_MAX];
+  char cwd[PATH_MAX];
+  char *dir;
+
+  if (getcwd(old, sizeof old) == NULL)
+    old[0] = 0;
+
+  if (argc < 2)
+    dir = getenv("HOME");
+  else if (!strcmp(argv[1], "-"))
+    dir = getenv("OLDPWD");
+  else
+    dir = argv[1];
+
+  if (dir == NULL) {
+    errno = 0;
+    error("cd: %s not set", argc < 2 ? "HOME" : "OLDPWD");
+    return 1;
+  }
+
+  if (chdir(dir) < 0) {
+    error("cd: %s", dir);
+    return 1;
+  }
+
+  setenv("OLDPWD", old, 1);
+
+  if (getcwd(cwd, sizeof cwd) != NULL) {
+    setenv("PWD", cwd, 1);
+    if (argc > 1 && !strcmp(argv[1], "-"))
+      dprintf(out, "%s\n", cwd);
+  }
+
+  return 0;
+}
+
+static int builtin_pwd(char **argv, int argc, int out) {
+  char cwd[PATH_MAX];
+
+  if (getcwd(cwd, sizeof cwd) == NULL) {
+    error("pwd");
+    return 1;
+  }
 
-    if (c == EOF)
-      return EOF;
+  dprintf(out, "%s\n", cwd);
 
-    if (count < MAXBUF)
-      input_buf[count++] = c;
+  return 0;
+}
 
-    if (c == '\n' && count < MAXBUF) {
-      input_buf[count] = 0;
-      return count;
+/* builtin_echo: echo [-n] args */
+static int builtin_echo(char **argv, int argc, int out) {
+  char buf[MAXBUF];
+  bool newline;
+  size_t len, n;
+  int i;
+
+  newline = argc < 2 || strcmp(argv[1], "-n") != 0;
+  len = 0;
+
+  /* One write for the common short line. */
+  for (i = newline ? 1 : 2; i < argc; ++i) {
+    n = strlen(argv[i]);
+    if (len + n + 2 > sizeof buf) {
+      if (write(out, buf, len) < 0 || write(out, argv[i], n) < 0)
+        return 1;
+      len = 0;
+    } else {
+      memcpy(buf + len, argv[i], n);
+      len += n;
     }
+    if (i + 1 < argc)
+      buf[len++] = ' ';
+  }
+
+  if (newline)
+    buf[len++] = '\n';
 
-    if (c == '\n') {
-      printf("too long input line\n");
-      return fetch_line(prompt);
+  return write(out, buf, len) < 0;
+}
+
+static int builtin_exit(char **argv, int argc, int out) {
+  fflush(stdout);
+  exit(argc > 1 ? atoi(argv[1]) : 0);
+}
+
+static int builtin_true(char **argv, int argc, int out) { return 0; }
+
+static int builtin_false(char **argv, int argc, int out) { return 1; }
+
+/* builtin_export: export name=value ... sets the variables, export alone
+ * lists them. */
+static int builtin_export(char **argv, int argc, int out) {
+  char *value;
+  char **env;
+  int i;
+
+  if (argc == 1) {
+    for (env = environ; *env != NULL; ++env)
+      dprintf(out, "export %s\n", *env);
+    return 0;
+  }
+
+  for (i = 1; i < argc; ++i) {
+    value = strchr(argv[i], '=');
+
+    /* Everything is exported already. */
+    if (value == NULL)
+      continue;
+
+    *value = 0;
+    if (setenv(argv[i], value + 1, 1) < 0) {
+      error("export: %s", argv[i]);
+      return 1;
     }
+    *value = '=';
+
+    /* Commands found along the old PATH may now resolve elsewhere. */
+    if (!strncmp(argv[i], "PATH=", 5))
+      init_search_path();
   }
+
+  return 0;
 }
 
-/* end_of_token: true if character c is not part of previous token. */
-static bool end_of_token(char c) {
-  switch (c) {
+/* test_unary: 1 if op arg holds, 0 if not, -1 for an unknown op. */
+static int test_unary(char *op, char *arg) {
+  struct stat st;
+
+  if (!strcmp(op, "-n"))
+    return *arg != 0;
+  if (!strcmp(op, "-z"))
+    return *arg == 0;
+  if (!strcmp(op, "-r"))
+    return access(arg, R_OK) == 0;
+  if (!strcmp(op, "-w"))
+    return access(arg, W_OK) == 0;
+  if (!strcmp(op, "-x"))
+    return access(arg, X_OK) == 0;
+
+  if (op[0] != '-' || op[1] == 0 || op[2] != 0 || !strchr("efds", op[1]))
+    return -1;
+
+  if (stat(arg, &st) < 0)
+    return 0;
+
+  switch (op[1]) {
+  case 'f':
+    return S_ISREG(st.st_mode);
+  case 'd':
+    return S_ISDIR(st.st_mode);
+  case 's':
+    return st.st_size > 0;
+  default:
+    return 1;
+  }
+}
+
+/* test_binary: as test_unary for a op b. */
+static int test_binary(char *a, char *op, char *b) {
+  static char *ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+  long x, y;
+  unsigned i;
+
+  if (!strcmp(op, "="))
+    return !strcmp(a, b);
+  if (!strcmp(op, "!="))
+    return strcmp(a, b) != 0;
+
+  for (i = 0; i < sizeof ops / sizeof ops[0]; ++i)
+    if (!strcmp(op, ops[i]))
+      break;
+
+  if (i == sizeof ops / sizeof ops[0])
+    return -1;
+
+  x = strtol(a, NULL, 10);
+  y = strtol(b, NULL, 10);
+
+  switch (i) {
   case 0:
-  case ' ':
-  case '\t':
-  case '\n':
-  case ';':
-  case '|':
-  case '&':
-  case '<':
-  case '>':
-    return true;
+    return x == y;
+  case 1:
+    return x != y;
+  case 2:
+    return x < y;
+  case 3:
+    return x <= y;
+  case 4:
+    return x > y;
+  default:
+    return x >= y;
+  }
+}
+
+static int test_eval(char **argv, int argc) {
+  int r;
 
+  if (argc > 0 && !strcmp(argv[0], "!")) {
+    r = test_eval(argv + 1, argc - 1);
+    return r < 0 ? r : !r;
+  }
+
+  switch (argc) {
+  case 0:
+    return 0;
+  case 1:
+    return *argv[0] != 0;
+  case 2:
+    return test_unary(argv[0], argv[1]);
+  case 3:
+    return test_binary(argv[0], argv[1], argv[2]);
   default:
-    return false;
+    return -1;
   }
 }
 
-/* gettoken: read one token and let *outptr point to it. */
-int gettoken(char **outptr) {
+/* builtin_test: test expr, or [ expr ]. Exit status 0 if true, 1 if
+ * false, 2 for a syntax error. */
+static int builtin_test(char **argv, int argc, int out) {
+  int r;
+
+  if (!strcmp(argv[0], "[")) {
+    if (strcmp(argv[argc - 1], "]") != 0) {
+      errno = 0;
+      error("[: missing ]");
+      return 2;
+    }
+    argc -= 1;
+  }
+
+  r = test_eval(argv + 1, argc - 1);
+
+  if (r < 0) {
+    errno = 0;
+    error("%s: syntax error", argv[0]);
+    return 2;
+  }
+
+  return !r;
+}
+
+static int builtin_parallel(char **argv, int argc, int out);
+
+typedef struct {
+  char *name;
+  int (*func)(char **argv, int argc, int out);
+} builtin_t;
+
+/* Sorted by name. */
+static builtin_t builtins[] = {
+    {"[", builtin_test},       {"bg", builtin_bg},     {"cd", builtin_cd},
+    {"echo", builtin_echo},    {"exit", builtin_exit}, {"export", builtin_export},
+    {"false", builtin_false},  {"fg", builtin_fg},     {"hash", builtin_hash},
+    {"jobs", builtin_jobs},    {"parallel", builtin_parallel},
+    {"pwd", builtin_pwd},      {"test", builtin_test}, {"true", builtin_true},
+    {"wait", builtin_wait},
+};
+
+static int compare_builtin(const void *key, const void *elem) {
+  return strcmp(key, ((const builtin_t *)elem)->name);
+}
+
+static builtin_t *find_builtin(char *name) {
+  return bsearch(name, builtins, sizeof builtins / sizeof builtins[0],
+                 sizeof builtins[0], compare_builtin);
+}
+
+/* launch: start argv with input_fd and output_fd as its stdin and
+ * stdout. A builtin runs in a forked child. Returns the pid, or -1. */
+static pid_t launch(char **argv, int argc, builtin_t *builtin) {
+  char *path;
+  pid_t pid;
+
+  path = builtin != NULL ? argv[0] : find_program(argv[0]);
+
+  if (builtin != NULL) {
+    pid = fork_child();
+    if (pid == 0) {
+      fflush(stdout);
+      _exit(builtin->func(argv, argc, 1));
+    }
+  } else if (path == NULL) {
+    errno = 0;
+    error("%s: command not found", argv[0]);
+    pid = -1;
+  } else if (use_fork)
+    pid = fork_program(path, argv);
+  else
+    pid = spawn_program(path, argv);
+
+  /* A remembered program that is gone: look again. */
+  if (pid < 0 && errno == ENOENT && builtin == NULL && path != argv[0]) {
+    hash_forget(argv[0]);
+    path = find_program(argv[0]);
+    if (path != NULL)
+      pid = use_fork ? fork_program(path, argv) : spawn_program(path, argv);
+  }
+
+  if (path != NULL && pid < 0)
+    error("cannot execute %s", argv[0]);
+
+  return pid;
+}
+
+/* par_finish: write the output of a finished parallel command and free
+ * its slot. Returns true if it failed. */
+static bool par_finish(slot_t *slot, int out) {
+  int status;
+  bool failed;
+
+  if (slot->out_len > 0 && write(out, slot->out, slot->out_len) < 0)
+    error("parallel: write");
+
+  status = slot->proc.status;
+  failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+
+  if (failed) {
+    errno = 0;
+    if (WIFEXITED(status))
+      error("parallel: exit %d: %s", WEXITSTATUS(status), slot->cmd);
+    else
+      error("parallel: signal %d: %s", WTERMSIG(status), slot->cmd);
+  }
+
+  free(slot->cmd);
+  slot->cmd = NULL;
+  slot->out_len = 0;
+  slot->proc.pid = 0;
+
+  return failed;
+}
+
+/* par_start: run one command line in slot. Returns false if it could not
+ * be started. Only words and < > redirections are allowed. */
+static bool par_start(slot_t *slot, char *line, long seq) {
+  char *saved_input_char;
+  char saved_pending;
+  char **argv;
+  int max_argc;
+  int argc;
+  int pipe_fd[2];
   token_type_t type;
+  pid_t pid;
+  bool ok;
 
-  *outptr = token;
+  slot->cmd = strdup(line);
+  slot->cmd[strcspn(slot->cmd, "\n")] = 0;
+  slot->seq = seq;
 
-  while (*input_char == ' ' || *input_char == '\t')
-    input_char++;
+  saved_input_char = input_char;
+  saved_pending = pending;
+  input_char = line;
+  pending = 0;
 
-  *token++ = *input_char;
+  input_fd = 0;
+  output_fd = 0;
+  argc = 0;
+  max_argc = 16;
+  argv = xrealloc(NULL, max_argc * sizeof argv[0]);
+  ok = true;
+
+  while (ok && (type = gettoken(&argv[argc])) != NEWLINE) {
+    if (argc + 2 > max_argc) {
+      max_argc *= 2;
+      argv = xrealloc(argv, max_argc * sizeof argv[0]);
+    }
 
-  switch (*input_char++) {
-  case '\n':
-    type = NEWLINE;
-    break;
+    if (type == NORMAL) {
+      argc += 1;
+    } else if (type == INPUT && gettoken(&argv[argc]) == NORMAL) {
+      if (input_fd != 0)
+        close(input_fd);
+      input_fd = open(argv[argc], O_RDONLY | O_CLOEXEC);
+      ok = input_fd >= 0;
+    } else if (type == OUTPUT && gettoken(&argv[argc]) == NORMAL) {
+      if (output_fd != 0)
+        close(output_fd);
+      output_fd =
+          open(argv[argc], O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, PERM);
+      ok = output_fd >= 0;
+    } else {
+      errno = 0;
+      ok = false;
+    }
+  }
 
-  case '<':
-    type = INPUT;
-    break;
+  argv[argc] = NULL;
+  input_char = saved_input_char;
+  pending = saved_pending;
 
-  case '>':
-    type = OUTPUT;
-    break;
+  if (argc == 0) {
+    errno = 0;
+    ok = false;
+  }
 
-  case '&':
-    type = AMPERSAND;
-    break;
+  slot->out_fd = -1;
 
-  case '|':
-    type = PIPE;
-    break;
+  /* The commands do not compete for the shell's input. */
+  if (ok && input_fd == 0) {
+    input_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    ok = input_fd >= 0;
+  }
 
-  default:
-    type = NORMAL;
+  if (ok && output_fd == 0) {
+    ok = pipe2(pipe_fd, O_CLOEXEC) == 0;
+    if (ok) {
+      output_fd = pipe_fd[1];
+      slot->out_fd = pipe_fd[0];
+    }
+  }
+
+  pid = ok ? launch(argv, argc, find_builtin(argv[0])) : -1;
+
+  if (!ok)
+    error("parallel: cannot run %s", slot->cmd);
+
+  if (input_fd > 0)
+    close(input_fd);
+
+  if (output_fd > 0)
+    close(output_fd);
 
-    while (!end_of_token(*input_char))
-      *token++ = *input_char++;
+  input_fd = 0;
+  output_fd = 0;
+  free(argv);
+
+  if (pid < 0) {
+    if (slot->out_fd >= 0)
+      close(slot->out_fd);
+    free(slot->cmd);
+    slot->cmd = NULL;
+    return false;
   }
 
-  *token++ = 0; /* null-terminate the string. */
+  memset(&slot->proc, 0, sizeof slot->proc);
+  slot->proc.pid = pid;
+  slot->finished = false;
 
-  return type;
+  return true;
 }
 
-/* error: print error message using formatting string similar to printf. */
-void error(char *fmt, ...) {
-  va_list ap;
+/* par_read: collect what the command in slot has written. */
+static void par_read(slot_t *slot) {
+  ssize_t n;
 
-  fprintf(stderr, "%s: error: ", progname);
+  if (slot->out_size - slot->out_len < MAXBUF) {
+    slot->out_size = slot->out_size ? 2 * slot->out_size : 8 * MAXBUF;
+    slot->out = xrealloc(slot->out, slot->out_size);
+  }
 
-  va_start(ap, fmt);
-  vfprintf(stderr, fmt, ap);
-  va_end(ap);
+  n = read(slot->out_fd, slot->out + slot->out_len,
+           slot->out_size - slot->out_len);
 
-  /* print system error code if errno is not zero. */
-  if (errno != 0) {
-    fprintf(stderr, ": ");
-    perror(0);
-  } else
-    fputc('\n', stderr);
+  if (n > 0)
+    slot->out_len += n;
+  else if (n == 0 || errno != EINTR) {
+    close(slot->out_fd);
+    slot->out_fd = -1;
+  }
+}
+
+/* builtin_parallel: parallel -j N [-k] [file]
+ *
+ * Runs the command lines in file, or the input, with at most N at a time.
+ * The output of each command is collected and written when it is done, or
+ * with -k in input order. Failures and the wall time go to stderr. */
+static int builtin_parallel(char **argv, int argc, int out) {
+  struct pollfd *pfd;
+  struct timespec t0, t1;
+  sigset_t old, wait_mask;
+  slot_t *slot;
+  FILE *in;
+  char *line;
+  size_t line_size;
+  long seq, next_seq, failed, nlines;
+  bool keep_order, eof, busy;
+  int jobs, i, n, fd;
+
+  jobs = 0;
+  keep_order = false;
+  fd = input_fd != 0 ? dup(input_fd) : dup(0);
+
+  for (i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-j") && i + 1 < argc)
+      jobs = atoi(argv[++i]);
+    else if (!strncmp(argv[i], "-j", 2))
+      jobs = atoi(argv[i] + 2);
+    else if (!strcmp(argv[i], "-k"))
+      keep_order = true;
+    else {
+      close(fd);
+      fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+    }
+  }
+
+  if (jobs <= 0)
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+  in = fd >= 0 ? fdopen(fd, "r") : NULL;
+  if (in == NULL) {
+    error("parallel: cannot read commands");
+    if (fd >= 0)
+      close(fd);
+    return 1;
+  }
+
+  par_slots = xrealloc(NULL, jobs * sizeof par_slots[0]);
+  memset(par_slots, 0, jobs * sizeof par_slots[0]);
+  npar_slots = jobs;
+  pfd = xrealloc(NULL, jobs * sizeof pfd[0]);
+  in_parallel = true;
+
+  block_sigchld(&old);
+  wait_mask = old;
+  sigdelset(&wait_mask, SIGCHLD);
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  line = NULL;
+  line_size = 0;
+  seq = next_seq = failed = nlines = 0;
+  eof = false;
+
+  for (;;) {
+    /* Fill the free slots. Lines that cannot be started get no number. */
+    for (i = 0; i < jobs && !eof; ++i) {
+      while (!eof && par_slots[i].proc.pid == 0) {
+        if (getline(&line, &line_size, in) < 0)
+          eof = true;
+        else if (line[strspn(line, " \t\n")] == 0)
+          continue;
+        else if (nlines++, par_start(&par_slots[i], line, seq))
+          seq += 1;
+        else
+          failed += 1;
+      }
+    }
+
+    n = 0;
+    busy = false;
+    for (i = 0; i < jobs; ++i) {
+      busy |= par_slots[i].proc.pid != 0;
+      if (par_slots[i].out_fd >= 0) {
+        pfd[n].fd = par_slots[i].out_fd;
+        pfd[n].events = POLLIN;
+        n += 1;
+      }
+    }
+
+    if (!busy && eof)
+      break;
+
+    /* Output, or SIGCHLD: ppoll unblocks it only while it sleeps. */
+    if (ppoll(pfd, n, NULL, &wait_mask) > 0) {
+      for (i = 0, n = 0; i < jobs; ++i) {
+        if (par_slots[i].out_fd >= 0 && pfd[n++].revents != 0)
+          par_read(&par_slots[i]);
+      }
+    }
+
+    update_jobs();
+
+    /* Done when it has exited and its output is drained. */
+    for (i = 0; i < jobs; ++i) {
+      slot = &par_slots[i];
+      if (slot->proc.pid == 0 || !slot->proc.done || slot->out_fd >= 0)
+        continue;
+      if (keep_order)
+        slot->finished = true;
+      else
+        failed += par_finish(slot, out);
+    }
+
+    /* With -k, in input order. */
+    while (keep_order) {
+      for (i = 0; i < jobs; ++i)
+        if (par_slots[i].proc.pid != 0 && par_slots[i].seq == next_seq)
+          break;
+      if (i == jobs || !par_slots[i].finished)
+        break;
+      failed += par_finish(&par_slots[i], out);
+      next_seq += 1;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  sigprocmask(SIG_SETMASK, &old, NULL);
+  in_parallel = false;
+
+  errno = 0;
+  fprintf(stderr, "parallel: %ld commands, %ld failed, %.3f s\n", nlines, failed,
+          (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9);
+
+  for (i = 0; i < jobs; ++i)
+    free(par_slots[i].out);
+
+  free(par_slots);
+  par_slots = NULL;
+  npar_slots = 0;
+  free(pfd);
+  free(line);
+  fclose(in);
+
+  return failed != 0;
 }
 
-/* run_program: fork and exec a program. */
+/* run_program: start a program. Every stage of a pipeline is started
+ * before the shell waits for any of them, and then only if the pipeline
+ * runs in the foreground. */
 void run_program(char **argv, int argc, bool foreground, bool doing_pipe) {
-  /* you need to fork, search for the command in argv[0],
-   * setup stdin and stdout of the child process, execv it.
-   * the parent should sometimes wait and sometimes not wait for
-   * the child process (you must figure out when). if foreground
-   * is true then basically you should wait but when we are
-   * running a command in a pipe such as PROG1 | PROG2 you might
-   * not want to wait for each of PROG1 and PROG2...
-   *
-   * hints:
-   *  snprintf is useful for constructing strings.
-   *  access is useful for checking wether a path refers to an
-   *      executable program.
-   *
-   *
-   */
+  struct timespec start;
+  builtin_t *builtin;
+  pid_t pid;
+
+  builtin = find_builtin(argv[0]);
+
+  /* Last stage: run it in the shell, so that cd and exit work. Earlier
+   * stages run in a child, or their output could fill the pipe before
+   * its reader is started. */
+  if (builtin != NULL && !doing_pipe) {
+    builtin->func(argv, argc, output_fd != 0 ? output_fd : 1);
+
+    if (input_fd != 0)
+      close(input_fd);
+
+    if (output_fd != 0)
+      close(output_fd);
+
+    finish_pipeline(foreground);
+    return;
+  }
+
+  /* Until the pipeline is complete no stage may be reaped: its pid may
+   * be the process group of the later stages. */
+  if (!launching) {
+    block_sigchld(&launch_mask);
+    launching = true;
+  }
+
+  /* Before launch: the child may run, and even finish, before it returns. */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pid = launch(argv, argc, builtin);
+
+  /* The child has its own copies now. */
+  if (input_fd != 0)
+    close(input_fd);
+
+  if (output_fd != 0)
+    close(output_fd);
+
+  if (pid > 0)
+    add_stage(pid, argv, &start);
+
+  if (!doing_pipe)
+    finish_pipeline(foreground);
 }
 
 void parse_line(void) {
-  char *argv[MAX_ARG + 1];
+  char **argv;
+  char **new_argv;
+  int max_argc;
   int argc;
-  //	int		pipe_fd[2];	/* 1 for producer and 0 for consumer. */
+  int pipe_fd[2]; /* 1 for producer and 0 for consumer. */
   token_type_t type;
   bool foreground;
   bool doing_pipe;
+  bool pipeline_start;
 
   input_fd = 0;
   output_fd = 0;
   argc = 0;
+  pipeline_start = true;
+  time_next = false;
+
+  arena_reset();
+  max_argc = 16;
+  argv = arena_alloc(max_argc * sizeof argv[0]);
 
   for (;;) {
 
     foreground = true;
     doing_pipe = false;
 
+    /* Room for one more token and the NULL after the arguments. */
+    if (argc + 2 > max_argc) {
+      new_argv = arena_alloc(2 * max_argc * sizeof argv[0]);
+      memcpy(new_argv, argv, argc * sizeof argv[0]);
+      argv = new_argv;
+      max_argc *= 2;
+    }
+
     type = gettoken(&argv[argc]);
 
     switch (type) {
     case NORMAL:
+      /* time prefix: report on the whole pipeline when it is done. */
+      if (argc == 0 && pipeline_start && !time_next &&
+          !strcmp(argv[0], "time")) {
+        time_next = true;
+        clock_gettime(CLOCK_MONOTONIC, &time_start);
+        break;
+      }
+
       argc += 1;
       break;
 
@@ -202,7 +1853,7 @@ void parse_line(void) {
         return;
       }
 
-      input_fd = open(argv[argc], O_RDONLY);
+      input_fd = open(argv[argc], O_RDONLY | O_CLOEXEC);
 
       if (input_fd < 0)
         error("cannot read from %s", argv[argc]);
@@ -216,7 +1867,8 @@ void parse_line(void) {
         return;
       }
 
-      output_fd = open(argv[argc], O_CREAT | O_WRONLY, PERM);
+      output_fd =
+          open(argv[argc], O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, PERM);
 
       if (output_fd < 0)
         error("cannot write to %s", argv[argc]);
@@ -235,14 +1887,47 @@ void parse_line(void) {
     case NEWLINE:
     case SEMICOLON:
 
-      if (argc == 0)
+      if (argc == 0) {
+        /* The read end of the last pipe, or a redirection, has no
+         * command to go to. */
+        if (!pipeline_start) {
+          errno = 0;
+          error("missing command after |");
+        }
+
+        if (input_fd > 0)
+          close(input_fd);
+
+        if (output_fd > 0)
+          close(output_fd);
+
         return;
+      }
 
       argv[argc] = NULL;
 
+      if (doing_pipe) {
+        /* Close on exec, so that no other stage holds on to the ends:
+         * the stages are all running at the same time. */
+        if (pipe2(pipe_fd, O_CLOEXEC) < 0) {
+          error("cannot create pipe");
+          return;
+        }
+
+        if (pipe_size > 0 && fcntl(pipe_fd[1], F_SETPIPE_SZ, pipe_size) < 0)
+          error("cannot set pipe size to %d", pipe_size);
+
+        /* An explicit > wins; the next stage then reads end of file. */
+        if (output_fd == 0)
+          output_fd = pipe_fd[1];
+        else
+          close(pipe_fd[1]);
+      }
+
       run_program(argv, argc, foreground, doing_pipe);
 
-      input_fd = 0;
+      pipeline_start = !doing_pipe;
+      input_fd = doing_pipe ? pipe_fd[0] : 0;
       output_fd = 0;
       argc = 0;
 
@@ -254,76 +1939,89 @@ void parse_line(void) {
   }
 }
 
-/* init_search_path: make a list of directories to look for programs in. */
-static void init_search_path(void) {
-  char *dir_start;
-  char *path;
-  char *s;
-  list_t *p;
-  bool proceed;
-
-  path = getenv("PATH");
-
-  /* path may look like "/bin:/usr/bin:/usr/local/bin"
-   * and this function makes a list with strings
-   * "/bin" "usr/bin" "usr/local/bin"
-   *
-   */
+/* init_jobs: catch SIGCHLD and, on a terminal, take part in job control. */
+static void init_jobs(void) {
+  struct sigaction sa;
+  int sig;
 
-  dir_start = malloc(1 + strlen(path));
-  if (dir_start == NULL) {
-    error("out of memory.");
-    exit(1);
-  }
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = sigchld_handler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGCHLD, &sa, NULL);
 
-  strcpy(dir_start, path);
+  sigemptyset(&job_signals);
+  sigaddset(&job_signals, SIGINT);
+  sigaddset(&job_signals, SIGQUIT);
+  sigaddset(&job_signals, SIGTSTP);
+  sigaddset(&job_signals, SIGTTIN);
+  sigaddset(&job_signals, SIGTTOU);
 
-  path_dir_list = NULL;
+  interactive = script_fd == 0 && isatty(0) && tcgetpgrp(0) == getpgrp();
 
-  if (path == NULL || *path == 0) {
-    path_dir_list = new_list("");
+  if (!interactive)
     return;
-  }
-
-  proceed = true;
-
-  while (proceed) {
-    s = dir_start;
-    while (*s != ':' && *s != 0)
-      s++;
-    if (*s == ':')
-      *s = 0;
-    else
-      proceed = false;
 
-    insert_last(&path_dir_list, dir_start);
+  shell_pgid = getpgrp();
 
-    dir_start = s + 1;
-  }
-
-  p = path_dir_list;
-
-  if (p == NULL)
-    return;
+  sa.sa_handler = SIG_IGN;
+  sa.sa_flags = 0;
 
-#if 0
-	do {
-		printf("%s\n", (char*)p->data);
-		p = p->succ;
-	} while (p != path_dir_list);
-#endif
+  for (sig = 1; sig < NSIG; ++sig)
+    if (sigismember(&job_signals, sig) == 1)
+      sigaction(sig, &sa, NULL);
 }
 
 /* main: main program of simple shell. */
+/* usage: explain the command line and give up. */
+static void usage(void) {
+  fprintf(stderr, "usage: %s [-n] [-f] [-p bytes] [-l log] [file]\n",
+          progname);
+  exit(2);
+}
+
 int main(int argc, char **argv) {
-  char *prompt = (argc >= 2 && !strncmp(argv[1], "-n", 3)) ? "" : "% ";
+  char *prompt = "% ";
+  int i;
 
   progname = argv[0];
 
+  /* -n: no prompt, -f: launch with fork (for comparison),
+   * -p bytes: pipe capacity, -l log: append every job to log as JSON,
+   * file: run the commands in file. */
+  for (i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-n"))
+      prompt = "";
+    else if (!strcmp(argv[i], "-f"))
+      use_fork = true;
+    else if (!strcmp(argv[i], "-p") && i + 1 < argc)
+      pipe_size = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-l") && i + 1 < argc) {
+      log_fd = open(argv[++i], O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, PERM);
+      if (log_fd < 0)
+        error("cannot write to %s", argv[i]);
+    } else if (argv[i][0] == '-' || script_fd != 0)
+      usage();
+    else {
+      script_fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+      if (script_fd < 0) {
+        error("cannot read %s", argv[i]);
+        return 127;
+      }
+      prompt = "";
+    }
+  }
+
   init_search_path();
+  init_jobs();
 
-  while (fetch_line(prompt) != EOF)
+  while (fetch_line(prompt) != EOF) {
     parse_line();
 
+    /* Stages started before a syntax error. */
+    finish_pipeline(true);
+    notify_jobs();
+  }
+
   return 0;
 }
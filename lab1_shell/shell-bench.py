@@ -0,0 +1,121 @@
+#!/bin/env python3
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+# Benchmarks for the shell, compared with dash when it is installed.
+#
+# Run as: shell-bench.py [--bytes N] SHELL_EXEC [CSV_FILE]
+#
+# Every result is one CSV row: shell,benchmark,metric,value,unit
+#   launch-*     round trip latency of one command, as percentiles
+#   script-*     throughput of a generated script run as SHELL FILE
+#   pipeline-N   bytes per second through N filters, cat and tr in turn,
+#                into wc -c. --bytes sets how many (default 512 MiB)
+#   jobs         background jobs started and reaped per second
+
+MARKER = b'__bench_done__'
+
+# round trips: send cmd followed by an echo of the marker, wait for the
+# marker. The shell reads its commands from a pipe, as in a script.
+def bench_latency(argv, cmd, n=2000, warmup=100):
+	p = subprocess.Popen(argv, stdin=subprocess.PIPE, stdout=subprocess.PIPE, bufsize=0)
+	line = (cmd + '\necho ' + MARKER.decode() + '\n').encode()
+	samples = []
+	for i in range(n + warmup):
+		t0 = time.perf_counter()
+		p.stdin.write(line)
+		buf = b''
+		while MARKER not in buf:
+			buf += os.read(p.stdout.fileno(), 4096)
+		if i >= warmup:
+			samples.append(time.perf_counter() - t0)
+	p.stdin.close()
+	p.wait()
+	samples.sort()
+	return samples
+
+def percentile(samples, q):
+	return samples[min(len(samples) - 1, int(q * len(samples)))]
+
+def bench_script(argv, lines, n):
+	with tempfile.NamedTemporaryFile('w', suffix='.sh') as f:
+		f.write(''.join(lines))
+		f.flush()
+		t0 = time.perf_counter()
+		subprocess.run(argv + [f.name], stdout=subprocess.DEVNULL, check=True)
+		return n / (time.perf_counter() - t0)
+
+# filters that pass every byte on, so that wc -c at the end sees them all
+FILTERS = ['cat', 'tr a-z A-Z']
+
+def bench_pipeline(argv, stages, nbytes):
+	filters = ''.join(' | ' + FILTERS[i % len(FILTERS)] for i in range(stages))
+	cmd = f'head -c {nbytes} /dev/zero' + filters + ' | wc -c\n'
+	t0 = time.perf_counter()
+	out = subprocess.run(argv, input=cmd.encode(), stdout=subprocess.PIPE, check=True).stdout
+	t = time.perf_counter() - t0
+	if str(nbytes) not in out.decode():
+		sys.exit(f'pipeline produced {out}')
+	return nbytes / t
+
+def bench_jobs(argv, n=2000):
+	script = '/bin/true &\n' * n + 'wait\n'
+	t0 = time.perf_counter()
+	subprocess.run(argv, input=script.encode(), stdout=subprocess.DEVNULL, check=True)
+	return n / (time.perf_counter() - t0)
+
+def run(name, argv, emit, tmpdir, nbytes):
+	os.chdir(tmpdir)
+	with open('in.txt', 'w') as f:
+		f.write('hello\n')
+
+	launch = [
+		('launch-true', '/bin/true'),
+		('launch-builtin', 'true'),
+		('launch-echo-redirect', 'echo hello > out.txt'),
+		('launch-cat-redirect', 'cat < in.txt > out.txt'),
+		('launch-pipe', '/bin/true | /bin/true'),
+	]
+	for bench, cmd in launch:
+		samples = bench_latency(argv, cmd)
+		for metric, q in [('p50', .5), ('p90', .9), ('p99', .99)]:
+			emit(name, bench, metric, percentile(samples, q) * 1e6, 'us')
+		emit(name, bench, 'mean', sum(samples) / len(samples) * 1e6, 'us')
+
+	n = 100000
+	for bench, line in [('script-echo', 'echo hello\n'), ('script-test', 'test 1 -lt 2\n')]:
+		emit(name, bench, 'rate', bench_script(argv, [line] * n, n), 'lines/s')
+
+	for stages in [1, 4, 8]:
+		emit(name, f'pipeline-{stages}', 'rate', bench_pipeline(argv, stages, nbytes) / 1e6, 'MB/s')
+
+	emit(name, 'jobs', 'rate', bench_jobs(argv), 'jobs/s')
+
+if __name__ == "__main__":
+	args = sys.argv[1:]
+	nbytes = 1 << 29
+	if len(args) >= 2 and args[0] == '--bytes' and args[1].isdigit():
+		nbytes = int(args[1])
+		args = args[2:]
+	if len(args) not in (1, 2):
+		sys.exit(f"Run as: {sys.argv[0]} [--bytes N] SHELL_EXEC [CSV_FILE]")
+
+	shell_exec = os.path.abspath(args[0])
+	shells = [('sh', [shell_exec, '-n']), ('sh-fork', [shell_exec, '-n', '-f'])]
+	if shutil.which('dash'):
+		shells.append(('dash', [shutil.which('dash')]))
+
+	out = open(args[1], 'w') if len(args) == 2 else sys.stdout
+
+	def emit(*row):
+		out.write(','.join(f'{x:.1f}' if isinstance(x, float) else str(x) for x in row) + '\n')
+		out.flush()
+
+	emit('shell', 'benchmark', 'metric', 'value', 'unit')
+	with tempfile.TemporaryDirectory() as tmpdir:
+		for name, argv in shells:
+			run(name, argv, emit, tmpdir, nbytes)
@@ -6,6 +6,7 @@ import sys
 import os
 import tempfile
 import re
+import shutil
 
 # Tested with sh, dash
 # prompt = '$'
@@ -63,6 +64,25 @@ def test_cmd(cmd, expstr=[], lines=1, timeout=1, mintime=None):
 	log.info(f"Test for {cmd} passed.")
 	return True
 
+# time reports the exit status of every stage; piping the command into cat
+# also runs builtins such as test in a process of their own.
+def test_exit(cmd, code, timeout=1):
+	log.info("TESTING:"+cmd)
+	clear_buf(p)
+
+	p.sendline(f'time {cmd} | cat')
+	try:
+		p.expect(rb'\n1 +\d+ +(\d+) ', timeout=timeout)
+	except pexpect.TIMEOUT:
+		log.error(f"Test for {cmd} failed: no exit status in {p.before}")
+		return False
+
+	if int(p.match.group(1)) != code:
+		log.error(f"Test for {cmd} failed: Expected exit {code} but got {p.match.group(1).decode()}")
+		return False
+	log.info(f"Test for {cmd} passed.")
+	return True
+
 if __name__ == "__main__":
 	if len(sys.argv) != 2:
 		log.error(f"Run as: {sys.argv[0]} SHELL_EXEC")
@@ -97,3 +117,51 @@ if __name__ == "__main__":
 			test_cmd(f'cd /home; cd ..; pwd; cd {tmpdir}',['/'])
 			test_cmd(f'cd /home; cd ..; cd ..; cd ..; pwd; cd {tmpdir}',['/'])
 			test_cmd('echo world &',['world'])
+			test_cmd('sleep 1 & wait; echo waited',['waited'],timeout=3,mintime=1)
+			test_cmd('sleep 5 & jobs',['Running'])
+			test_cmd('echo echo p1 > cmds.txt; parallel -j 2 cmds.txt',['p1'])
+			test_cmd('time sleep 1 | cat',['real 1.0'],timeout=3,mintime=1)
+			# No job notices between the hash tables and the prompt.
+			test_cmd('wait; echo waited',['waited'],timeout=6)
+			# Setting PATH empties the table; hash then shows where ls was
+			# found along it, as which finds it.
+			for path in ['/usr/bin:/bin', '/bin:/usr/bin']:
+				test_cmd(f'export PATH={path}; hash',['hits\tcommand\r\n%'])
+				test_cmd('ls > /dev/null; hash',['1\t'+shutil.which('ls', path=path)])
+			test_cmd('hash -r; hash',['hits\tcommand\r\n%'])
+			test_cmd('echo -n abc; echo def',['abcdef'])
+			test_cmd('echo -n',['%'])
+			test_cmd('export GREETING=hi; printenv GREETING',['hi'])
+			test_cmd('export',['export GREETING=hi'])
+			test_exit('test -f file1.txt', 0)
+			test_exit('test -d file1.txt', 1)
+			test_exit('[ -n abc ]', 0)
+			test_exit('[ abc = abd ]', 1)
+			test_exit('[ 3 -lt 10 ]', 0)
+			test_exit('[ ! 3 -lt 10 ]', 1)
+			test_exit('[ -z abc', 2)
+			# Lines longer than the 512 byte buffers the shell used to have.
+			test_cmd('echo '+'x'*600, ['x'*600])
+			test_cmd('echo '+'x'*600+' | wc -c', ['601'])
+			# A script bigger than one read, with a line spanning reads and
+			# a last line without a newline.
+			with open('script.sh', 'w') as f:
+				f.write('echo one\n' + 'echo '+'y'*200000+' | wc -c\n' + 'echo two')
+			test_cmd(f'{shell_exec} script.sh', ['one\r\n200001\r\ntwo'])
+			test_cmd(f'{shell_exec} missing.sh', ['cannot read missing.sh'])
+			test_cmd(f'{shell_exec} -x script.sh', ['usage:'])
+			# Many tokens grow argv well past its first 16 slots, and a token
+			# bigger than an arena block gets a block of its own.
+			words = ' '.join(f't{i}' for i in range(300))
+			test_cmd(f'echo {words} | wc -w', ['300'])
+			test_cmd(f'/bin/echo {words} | wc -w', ['300'])
+			with open('tokens.sh', 'w') as f:
+				f.write('/bin/echo ' + ' '.join(f't{i}' for i in range(5000)) + ' | wc -w\n')
+				f.write('/bin/echo ' + 'z'*10000 + ' ' + 'z'*10000 + ' | wc -c\n')
+			test_cmd(f'{shell_exec} tokens.sh', ['5000\r\n20002'])
+			# A pipe to nowhere is an error, and its read end is closed.
+			fds = len(os.listdir(f'/proc/{p.pid}/fd'))
+			test_cmd('echo hi |', ['missing command after'])
+			test_cmd('echo hi | ; echo hi |', ['missing command after'])
+			if len(os.listdir(f'/proc/{p.pid}/fd')) != fds:
+				log.error("Test for echo hi | failed: the shell leaks file descriptors")
@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+#include "dirtytrack.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Checkpoint cost against region size and write rate.
+ *
+ * usage: dirtytrack-bench [max_mb]
+ *
+ * For each region size and each fraction of pages written between two
+ * checkpoints, prints a CSV line with the cost of the writes (including
+ * the tracking faults) and of the checkpoint. "full" writes the whole
+ * region every time and is the baseline. Afterwards the checkpoints are
+ * restored into a fresh region and compared with the original.
+ */
+
+#define ROUNDS (4)
+
+static int sizes_mb[] = {16, 64, 256};
+static int dirty_pct[] = {1, 10, 50, 100};
+static char *mode_names[] = {"wprotect", "softdirty", "full"};
+
+static size_t page_size;
+static char tmpname[] = "/tmp/dirtytrack-XXXXXX";
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void die(char *what) {
+  perror(what);
+  unlink(tmpname);
+  exit(1);
+}
+
+/* run: one line of output. mode 2 is the full copy baseline, which uses a
+ * wprotect region without looking at its dirty bits. */
+static void run(int mode, int mb, int pct) {
+  dt_region_t *r, *copy;
+  size_t npages, ndirty, i, page;
+  long written;
+  double tw, tc;
+  char *base;
+  int round;
+  int fd;
+
+  r = dt_create((size_t)mb << 20, mode == 2 ? DT_WPROTECT : mode);
+  if (r == NULL) {
+    printf("%s,%d,%d,unsupported: %s\n", mode_names[mode], mb, pct,
+           strerror(errno));
+    return;
+  }
+
+  fd = mkstemp(tmpname);
+  if (fd < 0)
+    die(tmpname);
+
+  base = dt_base(r);
+  npages = dt_size(r) / page_size;
+  ndirty = npages * pct / 100;
+  written = 0;
+  tw = tc = 0;
+
+  /* Start from a fully populated region. */
+  memset(base, 1, dt_size(r));
+  if (mode == 2 ? write(fd, base, dt_size(r)) < 0 : dt_checkpoint(r, fd) < 0)
+    die("checkpoint");
+
+  for (round = 0; round < ROUNDS; ++round) {
+    tw -= now();
+    /* npages is a power of two, so an odd stride visits distinct pages. */
+    for (i = 0; i < ndirty; ++i) {
+      page = (i * 7919 + round) & (npages - 1);
+      base[page * page_size + round] = round + 2;
+    }
+    tw += now();
+
+    tc -= now();
+    if (mode == 2) {
+      if (write(fd, base, dt_size(r)) != (ssize_t)dt_size(r))
+        die("write");
+      written += npages;
+    } else {
+      if (dt_dirty(r) != ndirty) {
+        fprintf(stderr, "%s: %zu dirty pages, expected %zu\n",
+                mode_names[mode], dt_dirty(r), ndirty);
+        exit(1);
+      }
+      written += dt_checkpoint(r, fd);
+    }
+    tc += now();
+  }
+
+  printf("%s,%d,%d,%ld,%.0f,%.3f,%.0f\n", mode_names[mode], mb, pct,
+         written / ROUNDS, ndirty ? tw * 1e9 / (ndirty * ROUNDS) : 0.0,
+         tc * 1e3 / ROUNDS,
+         tc > 0 ? (double)written * page_size / (1 << 20) / tc : 0.0);
+
+  if (mode != 2) {
+    copy = dt_create(dt_size(r), mode);
+    if (copy == NULL || lseek(fd, 0, SEEK_SET) < 0 || dt_restore(copy, fd) < 0)
+      die("restore");
+    if (memcmp(dt_base(copy), base, dt_size(r)) != 0) {
+      fprintf(stderr, "%s: restored region differs\n", mode_names[mode]);
+      exit(1);
+    }
+    dt_destroy(copy);
+  }
+
+  close(fd);
+  unlink(tmpname);
+  strcpy(tmpname + strlen(tmpname) - 6, "XXXXXX");
+  dt_destroy(r);
+}
+
+int main(int argc, char **argv) {
+  int max_mb;
+  unsigned s, p;
+  int mode;
+
+  page_size = sysconf(_SC_PAGESIZE);
+  max_mb = argc > 1 ? atoi(argv[1]) : 64;
+
+  printf("mode,region_mb,dirty_pct,pages_per_checkpoint,write_ns_per_page,"
+         "checkpoint_ms,checkpoint_mb_per_sec\n");
+
+  for (s = 0; s < sizeof sizes_mb / sizeof sizes_mb[0]; ++s) {
+    if (sizes_mb[s] > max_mb)
+      break;
+    for (p = 0; p < sizeof dirty_pct / sizeof dirty_pct[0]; ++p)
+      for (mode = 0; mode < 3; ++mode)
+        run(mode, sizes_mb[s], dirty_pct[p]);
+  }
+
+  return 0;
+}
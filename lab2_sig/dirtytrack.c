@@ -0,0 +1,304 @@
+#define _GNU_SOURCE
+#include "dirtytrack.h"
+#include "segvdispatch.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SOFT_DIRTY (1ULL << 55)   /* pagemap entry bit. */
+#define WORD_BITS (sizeof(unsigned long) * CHAR_BIT)
+
+struct dt_region {
+  char *base;              /* start of the mapping. */
+  size_t size;             /* bytes, a multiple of the page size. */
+  size_t npages;           /* pages in the mapping. */
+  dt_mode_t mode;          /* how writes are caught. */
+  unsigned long *dirty;    /* one bit per page. */
+  uint64_t *pagemap;       /* DT_SOFTDIRTY: entries read from the kernel. */
+  int pagemap_fd;          /* DT_SOFTDIRTY: /proc/self/pagemap. */
+  int clear_refs_fd;       /* DT_SOFTDIRTY: /proc/self/clear_refs. */
+};
+
+static size_t page_size;
+
+void *dt_base(dt_region_t *r) { return r->base; }
+
+size_t dt_size(dt_region_t *r) { return r->size; }
+
+static void set_dirty(dt_region_t *r, size_t i) {
+  r->dirty[i / WORD_BITS] |= 1UL << (i % WORD_BITS);
+}
+
+static int is_dirty(dt_region_t *r, size_t i) {
+  return (r->dirty[i / WORD_BITS] >> (i % WORD_BITS)) & 1;
+}
+
+static int write_full(int fd, const void *buf, size_t n) {
+  const char *p = buf;
+  ssize_t k;
+
+  while (n > 0) {
+    k = write(fd, p, n);
+    if (k < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += k;
+    n -= k;
+  }
+
+  return 0;
+}
+
+/* read_full: returns the number of bytes read, short only at end of file. */
+static ssize_t read_full(int fd, void *buf, size_t n) {
+  char *p = buf;
+  ssize_t k;
+  size_t done;
+
+  for (done = 0; done < n; done += k) {
+    k = read(fd, p + done, n - done);
+    if (k < 0) {
+      if (errno == EINTR) {
+        k = 0;
+        continue;
+      }
+      return -1;
+    }
+    if (k == 0)
+      break;
+  }
+
+  return done;
+}
+
+/* Write protection mechanism. */
+
+/* wprotect_fault: first write to a clean page since the last checkpoint. */
+static void wprotect_fault(void *addr, void *arg) {
+  dt_region_t *r = arg;
+  size_t index;
+
+  index = ((char *)addr - r->base) / page_size;
+
+  set_dirty(r, index);
+  mprotect(r->base + index * page_size, page_size, PROT_READ | PROT_WRITE);
+}
+
+static int wprotect_attach(dt_region_t *r) {
+  if (sd_register(r->base, r->size, wprotect_fault, r) < 0)
+    return -1;
+
+  return mprotect(r->base, r->size, PROT_READ);
+}
+
+/* Soft dirty mechanism. */
+
+static int clear_soft_dirty(dt_region_t *r) {
+  return pwrite(r->clear_refs_fd, "4", 1, 0) == 1 ? 0 : -1;
+}
+
+/* read_pagemap: copy the soft dirty bits of the region into r->dirty. */
+static int read_pagemap(dt_region_t *r) {
+  off_t offset;
+  size_t n;
+  size_t i;
+
+  offset = (uintptr_t)r->base / page_size * sizeof r->pagemap[0];
+  n = r->npages * sizeof r->pagemap[0];
+
+  if (pread(r->pagemap_fd, r->pagemap, n, offset) != (ssize_t)n)
+    return -1;
+
+  memset(r->dirty, 0, (r->npages + WORD_BITS - 1) / WORD_BITS *
+                      sizeof r->dirty[0]);
+
+  for (i = 0; i < r->npages; ++i)
+    if (r->pagemap[i] & SOFT_DIRTY)
+      set_dirty(r, i);
+
+  return 0;
+}
+
+static int softdirty_attach(dt_region_t *r) {
+  volatile char *probe;
+
+  r->pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  r->clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+  r->pagemap = malloc(r->npages * sizeof r->pagemap[0]);
+
+  if (r->pagemap_fd < 0 || r->clear_refs_fd < 0 || r->pagemap == NULL)
+    return -1;
+
+  /* A write after clearing must show up, or the kernel lacks soft dirty
+   * support. Zero is written so the region stays zero filled. */
+  probe = r->base;
+  *probe = 0;
+
+  if (clear_soft_dirty(r) < 0 || read_pagemap(r) < 0)
+    return -1;
+
+  *probe = 0;
+
+  if (read_pagemap(r) < 0)
+    return -1;
+
+  if (!is_dirty(r, 0)) {
+    errno = ENOTSUP;
+    return -1;
+  }
+
+  return clear_soft_dirty(r);
+}
+
+/* rearm: everything is clean from here on. */
+static int rearm(dt_region_t *r) {
+  memset(r->dirty, 0, (r->npages + WORD_BITS - 1) / WORD_BITS *
+                      sizeof r->dirty[0]);
+
+  if (r->mode == DT_WPROTECT)
+    return mprotect(r->base, r->size, PROT_READ);
+
+  return clear_soft_dirty(r);
+}
+
+dt_region_t *dt_create(size_t size, dt_mode_t mode) {
+  dt_region_t *r;
+  int err;
+
+  if (page_size == 0)
+    page_size = sysconf(_SC_PAGESIZE);
+
+  r = calloc(1, sizeof *r);
+  if (r == NULL)
+    return NULL;
+
+  r->size = (size + page_size - 1) & ~(page_size - 1);
+  r->npages = r->size / page_size;
+  r->mode = mode;
+  r->pagemap_fd = -1;
+  r->clear_refs_fd = -1;
+  r->dirty = calloc((r->npages + WORD_BITS - 1) / WORD_BITS,
+                    sizeof r->dirty[0]);
+  r->base = mmap(NULL, r->size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (r->dirty == NULL || r->base == MAP_FAILED ||
+      (mode == DT_WPROTECT ? wprotect_attach(r) : softdirty_attach(r)) < 0) {
+    err = errno;
+    dt_destroy(r);
+    errno = err;
+    return NULL;
+  }
+
+  return r;
+}
+
+size_t dt_dirty(dt_region_t *r) {
+  size_t n;
+  size_t i;
+
+  if (r->mode == DT_SOFTDIRTY && read_pagemap(r) < 0)
+    return 0;
+
+  n = 0;
+  for (i = 0; i < (r->npages + WORD_BITS - 1) / WORD_BITS; ++i)
+    n += __builtin_popcountl(r->dirty[i]);
+
+  return n;
+}
+
+long dt_checkpoint(dt_region_t *r, int fd) {
+  dt_run_t run;
+  size_t i;
+  long written;
+
+  if (r->mode == DT_SOFTDIRTY && read_pagemap(r) < 0)
+    return -1;
+
+  written = 0;
+
+  for (i = 0; i < r->npages; ++i) {
+    if (!is_dirty(r, i))
+      continue;
+
+    /* Contiguous dirty pages go out as one run. */
+    run.first = i;
+    while (i < r->npages && is_dirty(r, i))
+      i += 1;
+    run.count = i - run.first;
+
+    if (write_full(fd, &run, sizeof run) < 0 ||
+        write_full(fd, r->base + run.first * page_size,
+                   run.count * page_size) < 0)
+      return -1;
+
+    written += run.count;
+  }
+
+  run.first = 0;
+  run.count = 0;
+
+  if (write_full(fd, &run, sizeof run) < 0 || rearm(r) < 0)
+    return -1;
+
+  return written;
+}
+
+int dt_restore(dt_region_t *r, int fd) {
+  dt_run_t run;
+  ssize_t n;
+
+  /* read() into read only pages fails with EFAULT instead of faulting. */
+  if (r->mode == DT_WPROTECT &&
+      mprotect(r->base, r->size, PROT_READ | PROT_WRITE) < 0)
+    return -1;
+
+  for (;;) {
+    n = read_full(fd, &run, sizeof run);
+    if (n < 0)
+      return -1;
+    if (n == 0)
+      break;
+
+    if (n != sizeof run || run.first > r->npages ||
+        run.count > r->npages - run.first) {
+      errno = EINVAL;
+      return -1;
+    }
+
+    n = read_full(fd, r->base + run.first * page_size, run.count * page_size);
+    if (n < 0)
+      return -1;
+    if ((size_t)n != run.count * page_size) {
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  return rearm(r);
+}
+
+void dt_destroy(dt_region_t *r) {
+  if (r->pagemap_fd >= 0)
+    close(r->pagemap_fd);
+
+  if (r->clear_refs_fd >= 0)
+    close(r->clear_refs_fd);
+
+  if (r->mode == DT_WPROTECT && r->base != MAP_FAILED)
+    sd_unregister(r->base);
+
+  if (r->base != MAP_FAILED)
+    munmap(r->base, r->size);
+
+  free(r->pagemap);
+  free(r->dirty);
+  free(r);
+}
@@ -0,0 +1,52 @@
+#ifndef dirtytrack_h
+#define dirtytrack_h
+
+#include <stddef.h>
+
+/* Dirty page tracking for incremental checkpoints.
+ *
+ * A region starts out zero filled and clean. dt_checkpoint appends the
+ * pages written since the last checkpoint to a file and marks everything
+ * clean again; dt_restore replays such a file from the beginning.
+ *
+ * Two mechanisms are offered:
+ *  DT_WPROTECT   clean pages are read only; a SIGSEGV handler sets the
+ *                page's bit in a dirty bitmap and makes it writable.
+ *  DT_SOFTDIRTY  the kernel tracks writes; dirty pages are read from
+ *                /proc/self/pagemap and reset through /proc/self/clear_refs.
+ *                clear_refs applies to the whole process.
+ *
+ * File format: each checkpoint is a sequence of runs, a dt_run_t header
+ * followed by count pages starting at page first, and ends with a run
+ * whose count is 0.
+ */
+
+typedef enum { DT_WPROTECT, DT_SOFTDIRTY } dt_mode_t;
+
+typedef struct {
+  unsigned long long first;
+  unsigned long long count;
+} dt_run_t;
+
+typedef struct dt_region dt_region_t;
+
+/* dt_create: map size bytes. Returns NULL and sets errno on failure, e.g.
+ * ENOTSUP if the kernel has no soft dirty bits. */
+dt_region_t *dt_create(size_t size, dt_mode_t mode);
+
+/* dt_checkpoint: append the dirty pages to fd. Returns the number of pages
+ * written, or -1 with errno set. */
+long dt_checkpoint(dt_region_t *r, int fd);
+
+/* dt_restore: apply every checkpoint in fd, from its current offset to
+ * the end. Returns 0, or -1 with errno set. */
+int dt_restore(dt_region_t *r, int fd);
+
+/* dt_dirty: number of pages written since the last checkpoint. */
+size_t dt_dirty(dt_region_t *r);
+
+void *dt_base(dt_region_t *r);
+size_t dt_size(dt_region_t *r);
+void dt_destroy(dt_region_t *r);
+
+#endif
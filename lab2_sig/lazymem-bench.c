@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+#include "lazymem.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+
+/* Fault handling cost of plain mmap, SIGSEGV and userfaultfd.
+ *
+ * usage: lazymem-bench [pages [passes [budget]]]
+ *
+ * Every pass touches each page once in order. With a budget smaller than
+ * the number of pages every touch after the first pass faults again, so
+ * all the time counts towards ns/fault; with a budget of all the pages the
+ * later passes are timed too but do not fault. Plain mmap only faults on
+ * the first touch of a page, so only that pass is timed.
+ */
+
+static size_t npages = 16384;
+static int npasses = 4;
+static size_t budget;
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void fill(void *page, size_t index, void *arg) {
+  memset(page, 0, lm_page_size());
+  *(size_t *)page = index;
+}
+
+/* touch: read every page; returns a checksum so the loop is not dropped. */
+static size_t touch(char *base) {
+  size_t sum;
+  size_t i;
+  int pass;
+
+  sum = 0;
+  for (pass = 0; pass < npasses; ++pass)
+    for (i = 0; i < npages; ++i)
+      sum += *(volatile size_t *)(base + i * lm_page_size());
+
+  return sum;
+}
+
+static long minflt(void) {
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_minflt;
+}
+
+static void report(char *name, double seconds, unsigned long long faults,
+                   unsigned long long evictions) {
+  printf("%-14s %10llu faults %10llu evictions %8.3f ms %8.0f ns/fault\n",
+         name, faults, evictions, seconds * 1e3,
+         faults ? seconds * 1e9 / faults : 0.0);
+}
+
+static void bench_mmap(void) {
+  size_t size;
+  char *base;
+  long before;
+  double t;
+  size_t i;
+
+  size = npages * lm_page_size();
+  base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+              -1, 0);
+  if (base == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+
+  before = minflt();
+  t = now();
+
+  /* Write so that every page gets its own frame, like fill does. */
+  for (i = 0; i < npages; ++i)
+    base[i * lm_page_size()] = 1;
+
+  t = now() - t;
+  report("mmap", t, minflt() - before, 0);
+
+  munmap(base, size);
+}
+
+static void bench_lazy(char *name, lm_mode_t mode) {
+  lm_region_t *r;
+  lm_stats_t st;
+  size_t expect;
+  double t;
+
+  r = lm_create(npages * lm_page_size(), budget, mode, fill, NULL);
+  if (r == NULL) {
+    printf("%-14s unsupported: %s\n", name, strerror(errno));
+    return;
+  }
+
+  expect = (size_t)npasses * npages * (npages - 1) / 2;
+
+  t = now();
+  if (touch(lm_base(r)) != expect) {
+    fprintf(stderr, "%s: wrong page contents\n", name);
+    exit(1);
+  }
+  t = now() - t;
+
+  st = lm_stats(r);
+  report(name, t, st.faults, st.evictions);
+
+  lm_destroy(r);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1)
+    npages = strtoul(argv[1], NULL, 0);
+  if (argc > 2)
+    npasses = atoi(argv[2]);
+
+  budget = argc > 3 ? strtoul(argv[3], NULL, 0) : npages / 2;
+
+  printf("%zu pages of %zu bytes, %d passes, budget %zu pages\n", npages,
+         lm_page_size(), npasses, budget);
+
+  bench_mmap();
+  bench_lazy("sigsegv", LM_SIGSEGV);
+  bench_lazy("userfaultfd", LM_USERFAULTFD);
+
+  return 0;
+}
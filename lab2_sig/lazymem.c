@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+#include "lazymem.h"
+#include "segvdispatch.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct lm_region {
+  char *base;         /* start of the reserved range. */
+  size_t size;        /* bytes, a multiple of the page size. */
+  size_t npages;      /* pages in the range. */
+  size_t budget;      /* max resident pages, 0 if unlimited. */
+  size_t *resident;   /* ring of resident page indices, oldest first. */
+  size_t oldest;      /* ring index of the oldest resident page. */
+  size_t nresident;   /* pages in the ring. */
+  lm_mode_t mode;     /* how faults are caught. */
+  lm_fill_fn fill;    /* produces page contents. */
+  void *arg;          /* passed to fill. */
+  int fd;             /* backing file, or -1. */
+  int uffd;           /* userfaultfd, or -1. */
+  pthread_t thread;   /* userfaultfd handler. */
+  int thread_started; /* thread was created and must be joined. */
+  char *staging;      /* page filled before UFFDIO_COPY. */
+  lm_stats_t stats;
+};
+
+static size_t page_size;
+
+size_t lm_page_size(void) {
+  if (page_size == 0)
+    page_size = sysconf(_SC_PAGESIZE);
+  return page_size;
+}
+
+void *lm_base(lm_region_t *r) { return r->base; }
+
+size_t lm_size(lm_region_t *r) { return r->size; }
+
+lm_stats_t lm_stats(lm_region_t *r) { return r->stats; }
+
+/* evict: drop the oldest resident page. */
+static void evict(lm_region_t *r) {
+  char *page;
+
+  page = r->base + r->resident[r->oldest] * page_size;
+
+  if (r->mode == LM_SIGSEGV)
+    mprotect(page, page_size, PROT_NONE);
+
+  madvise(page, page_size, MADV_DONTNEED);
+
+  r->oldest = (r->oldest + 1) % r->budget;
+  r->nresident -= 1;
+  r->stats.evictions += 1;
+}
+
+/* make_room: called before page index becomes resident. */
+static void make_room(lm_region_t *r, size_t index) {
+  if (r->budget == 0)
+    return;
+
+  if (r->nresident == r->budget)
+    evict(r);
+
+  r->resident[(r->oldest + r->nresident) % r->budget] = index;
+  r->nresident += 1;
+}
+
+static void fill_from_file(void *page, size_t index, void *arg) {
+  lm_region_t *r = arg;
+  ssize_t n;
+
+  n = pread(r->fd, page, page_size, (off_t)index * page_size);
+
+  if (n < 0)
+    n = 0;
+
+  memset((char *)page + n, 0, page_size - n);
+}
+
+/* SIGSEGV mechanism. */
+
+/* segv_fault: called by the dispatcher for a fault inside the region. */
+static void segv_fault(void *addr, void *arg) {
+  lm_region_t *r = arg;
+  size_t index;
+
+  index = ((char *)addr - r->base) / page_size;
+
+  make_room(r, index);
+
+  mprotect(r->base + index * page_size, page_size, PROT_READ | PROT_WRITE);
+  r->fill(r->base + index * page_size, index, r->arg);
+  r->stats.faults += 1;
+}
+
+static int segv_attach(lm_region_t *r) {
+  r->base = mmap(NULL, r->size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS |
+                 MAP_NORESERVE, -1, 0);
+
+  if (r->base == MAP_FAILED)
+    return -1;
+
+  /* Nothing can fault in the range before it is registered. */
+  return sd_register(r->base, r->size, segv_fault, r);
+}
+
+/* userfaultfd mechanism. */
+
+static void *uffd_thread(void *arg) {
+  lm_region_t *r = arg;
+  struct uffd_msg msg;
+  struct uffdio_copy copy;
+  struct pollfd pfd;
+  size_t index;
+  uintptr_t addr;
+
+  pfd.fd = r->uffd;
+  pfd.events = POLLIN;
+
+  for (;;) {
+    if (poll(&pfd, 1, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      return NULL;
+    }
+
+    if (read(r->uffd, &msg, sizeof msg) != sizeof msg)
+      continue;
+
+    if (msg.event != UFFD_EVENT_PAGEFAULT)
+      continue;
+
+    addr = msg.arg.pagefault.address & ~(uintptr_t)(page_size - 1);
+    index = (addr - (uintptr_t)r->base) / page_size;
+
+    make_room(r, index);
+    r->fill(r->staging, index, r->arg);
+
+    copy.dst = addr;
+    copy.src = (uintptr_t)r->staging;
+    copy.len = page_size;
+    copy.mode = 0;
+    copy.copy = 0;
+
+    /* Count first: the copy wakes the faulting thread. */
+    r->stats.faults += 1;
+
+    /* EEXIST: someone else already populated it. */
+    if (ioctl(r->uffd, UFFDIO_COPY, &copy) < 0 && errno != EEXIST)
+      return NULL;
+  }
+}
+
+static int uffd_attach(lm_region_t *r) {
+  struct uffdio_api api;
+  struct uffdio_register reg;
+
+#ifdef SYS_userfaultfd
+  /* Without privileges only faults from user mode may be handled. */
+  r->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | UFFD_USER_MODE_ONLY);
+  if (r->uffd < 0)
+    r->uffd = syscall(SYS_userfaultfd, O_CLOEXEC);
+#else
+  errno = ENOSYS;
+#endif
+
+  if (r->uffd < 0)
+    return -1;
+
+  memset(&api, 0, sizeof api);
+  api.api = UFFD_API;
+
+  if (ioctl(r->uffd, UFFDIO_API, &api) < 0)
+    return -1;
+
+  r->base = mmap(NULL, r->size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  r->staging = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (r->base == MAP_FAILED || r->staging == MAP_FAILED)
+    return -1;
+
+  reg.range.start = (uintptr_t)r->base;
+  reg.range.len = r->size;
+  reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+
+  if (ioctl(r->uffd, UFFDIO_REGISTER, &reg) < 0)
+    return -1;
+
+  errno = pthread_create(&r->thread, NULL, uffd_thread, r);
+  if (errno)
+    return -1;
+
+  r->thread_started = 1;
+  return 0;
+}
+
+lm_region_t *lm_create(size_t size, size_t budget, lm_mode_t mode,
+                       lm_fill_fn fill, void *arg) {
+  lm_region_t *r;
+  int err;
+
+  lm_page_size();
+
+  r = calloc(1, sizeof *r);
+  if (r == NULL)
+    return NULL;
+
+  r->size = (size + page_size - 1) & ~(page_size - 1);
+  r->npages = r->size / page_size;
+  r->budget = budget < r->npages ? budget : 0;
+  r->mode = mode;
+  r->fill = fill;
+  r->arg = arg;
+  r->fd = -1;
+  r->uffd = -1;
+  r->base = MAP_FAILED;
+  r->staging = MAP_FAILED;
+
+  if (r->budget > 0) {
+    r->resident = malloc(r->budget * sizeof r->resident[0]);
+    if (r->resident == NULL) {
+      free(r);
+      return NULL;
+    }
+  }
+
+  if ((mode == LM_SIGSEGV ? segv_attach(r) : uffd_attach(r)) < 0) {
+    err = errno;
+    lm_destroy(r);
+    errno = err;
+    return NULL;
+  }
+
+  return r;
+}
+
+lm_region_t *lm_create_file(const char *path, size_t budget, lm_mode_t mode) {
+  lm_region_t *r;
+  struct stat st;
+  int fd;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+
+  r = lm_create(st.st_size, budget, mode, fill_from_file, NULL);
+  if (r == NULL) {
+    close(fd);
+    return NULL;
+  }
+
+  r->arg = r;
+  r->fd = fd;
+
+  return r;
+}
+
+void lm_destroy(lm_region_t *r) {
+  if (r->mode == LM_SIGSEGV && r->base != MAP_FAILED)
+    sd_unregister(r->base);
+
+  if (r->thread_started) {
+    pthread_cancel(r->thread);
+    pthread_join(r->thread, NULL);
+  }
+
+  if (r->uffd >= 0)
+    close(r->uffd);
+
+  if (r->base != MAP_FAILED)
+    munmap(r->base, r->size);
+
+  if (r->staging != MAP_FAILED)
+    munmap(r->staging, page_size);
+
+  if (r->fd >= 0)
+    close(r->fd);
+
+  free(r->resident);
+  free(r);
+}
@@ -0,0 +1,50 @@
+#ifndef lazymem_h
+#define lazymem_h
+
+#include <stddef.h>
+
+/* User level demand paging.
+ *
+ * A region reserves address space without backing it. The first access to
+ * a page calls the fill function, which must write the whole page, and
+ * the page becomes resident. With a budget, the oldest resident page is
+ * evicted (MADV_DONTNEED) before a new one comes in; touching it again
+ * refills it, so changes to evicted pages are lost.
+ *
+ * Two mechanisms are offered:
+ *  LM_SIGSEGV      the region is PROT_NONE; a SIGSEGV handler mprotects
+ *                  and fills the faulting page.
+ *  LM_USERFAULTFD  the region is registered with userfaultfd; a handler
+ *                  thread fills a staging page and installs it with
+ *                  UFFDIO_COPY.
+ */
+
+typedef enum { LM_SIGSEGV, LM_USERFAULTFD } lm_mode_t;
+
+/* fill: write page number index (page_size bytes) at page. */
+typedef void (*lm_fill_fn)(void *page, size_t index, void *arg);
+
+typedef struct {
+  unsigned long long faults;    /* pages filled. */
+  unsigned long long evictions; /* pages dropped to stay in budget. */
+} lm_stats_t;
+
+typedef struct lm_region lm_region_t;
+
+/* lm_create: reserve size bytes. budget is the max number of resident
+ * pages, 0 for no limit. Returns NULL and sets errno on failure, e.g.
+ * ENOSYS or EPERM if userfaultfd is not available. */
+lm_region_t *lm_create(size_t size, size_t budget, lm_mode_t mode,
+                       lm_fill_fn fill, void *arg);
+
+/* lm_create_file: like lm_create, with pages read from the file at path.
+ * Pages past the end of the file read as zeros. */
+lm_region_t *lm_create_file(const char *path, size_t budget, lm_mode_t mode);
+
+void *lm_base(lm_region_t *r);
+size_t lm_size(lm_region_t *r);
+size_t lm_page_size(void);
+lm_stats_t lm_stats(lm_region_t *r);
+void lm_destroy(lm_region_t *r);
+
+#endif
@@ -0,0 +1,111 @@
+#define _GNU_SOURCE
+#include "dirtytrack.h"
+#include "lazymem.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* lazymem and dirtytrack used together, under an application handler.
+ *
+ * usage: segvdispatch-test
+ *
+ * Interleaves demand paging faults, write protection faults and faults in
+ * a page owned by neither library, which must reach the application's own
+ * SIGSEGV handler. Then destroys the regions one at a time and checks that
+ * the survivors keep working and that the application handler is back in
+ * place at the end. Prints "ok" and exits 0 on success.
+ */
+
+#define PAGES (64)
+#define ROUNDS (1000)
+
+static size_t page_size;
+static char *foreign;      /* read only page owned by neither library. */
+static volatile int foreign_faults; /* seen by app_handler. */
+
+static void app_handler(int sig, siginfo_t *info, void *context) {
+  char *addr = info->si_addr;
+
+  if (addr < foreign || addr >= foreign + page_size) {
+    signal(SIGSEGV, SIG_DFL);
+    return;
+  }
+
+  foreign_faults += 1;
+  mprotect(foreign, page_size, PROT_READ | PROT_WRITE);
+}
+
+static void fill(void *page, size_t index, void *arg) {
+  memset(page, (int)index + 1, page_size);
+}
+
+static void fail(char *what) {
+  fprintf(stderr, "segvdispatch-test: %s\n", what);
+  exit(1);
+}
+
+int main(void) {
+  struct sigaction sa, cur;
+  lm_region_t *lm;
+  dt_region_t *dt;
+  volatile char *lbase, *dbase;
+  int i, page;
+
+  page_size = sysconf(_SC_PAGESIZE);
+
+  memset(&sa, 0, sizeof sa);
+  sa.sa_sigaction = app_handler;
+  sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGSEGV, &sa, NULL) < 0)
+    fail("sigaction");
+
+  foreign = mmap(NULL, page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+                 -1, 0);
+  lm = lm_create(PAGES * page_size, PAGES / 4, LM_SIGSEGV, fill, NULL);
+  dt = dt_create(PAGES * page_size, DT_WPROTECT);
+  if (foreign == MAP_FAILED || lm == NULL || dt == NULL)
+    fail("create");
+
+  lbase = lm_base(lm);
+  dbase = dt_base(dt);
+
+  for (i = 0; i < ROUNDS; ++i) {
+    page = (i * 7) % PAGES;
+    if (lbase[page * page_size + 1] != page + 1)
+      fail("lazymem page has the wrong contents");
+
+    dbase[page * page_size] = i;
+
+    if (i % 10 == 0) {
+      *(volatile char *)foreign = i; /* faults again once protected below. */
+      mprotect(foreign, page_size, PROT_READ);
+    }
+  }
+
+  if (dt_dirty(dt) != PAGES)
+    fail("dirtytrack missed writes");
+  if (foreign_faults != ROUNDS / 10)
+    fail("application handler missed faults");
+  if (lm_stats(lm).faults < PAGES)
+    fail("lazymem missed faults");
+
+  /* dirtytrack goes first; lazymem and the application keep working. */
+  dt_destroy(dt);
+  for (page = 0; page < PAGES; ++page)
+    if (lbase[page * page_size] != page + 1)
+      fail("lazymem broken after dt_destroy");
+  *(volatile char *)foreign = 1;
+  if (foreign_faults != ROUNDS / 10 + 1)
+    fail("application handler lost after dt_destroy");
+
+  lm_destroy(lm);
+  if (sigaction(SIGSEGV, NULL, &cur) < 0 || cur.sa_sigaction != app_handler)
+    fail("application handler not restored");
+
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,98 @@
+#define _GNU_SOURCE
+#include "segvdispatch.h"
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#define MAX_RANGES (32) /* ranges the handler can serve. */
+
+typedef struct {
+  char *base;     /* NULL if the slot is free. */
+  size_t size;
+  sd_fault_fn fn;
+  void *arg;
+} range_t;
+
+static range_t ranges[MAX_RANGES];
+static struct sigaction old_segv; /* action to pass foreign faults on to. */
+static int nranges;               /* ranges registered. */
+
+/* forward: hand a fault that is not ours to the previous action. */
+static void forward(int sig, siginfo_t *info, void *context) {
+  if ((old_segv.sa_flags & SA_SIGINFO) && old_segv.sa_sigaction != NULL) {
+    old_segv.sa_sigaction(sig, info, context);
+    return;
+  }
+
+  if (old_segv.sa_handler != SIG_DFL && old_segv.sa_handler != SIG_IGN) {
+    old_segv.sa_handler(sig);
+    return;
+  }
+
+  /* Default action: the access faults again and terminates the process.
+   * Ignoring a SIGSEGV would loop forever, so it is treated the same. */
+  signal(SIGSEGV, SIG_DFL);
+}
+
+static void segv_handler(int sig, siginfo_t *info, void *context) {
+  char *addr;
+  int i;
+
+  addr = info->si_addr;
+
+  for (i = 0; i < MAX_RANGES; ++i) {
+    if (ranges[i].base != NULL && addr >= ranges[i].base &&
+        addr < ranges[i].base + ranges[i].size) {
+      ranges[i].fn(addr, ranges[i].arg);
+      return;
+    }
+  }
+
+  forward(sig, info, context);
+}
+
+int sd_register(void *base, size_t size, sd_fault_fn fn, void *arg) {
+  struct sigaction sa;
+  int i;
+
+  for (i = 0; i < MAX_RANGES; ++i)
+    if (ranges[i].base == NULL)
+      break;
+
+  if (i == MAX_RANGES) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  if (nranges == 0) {
+    memset(&sa, 0, sizeof sa);
+    sa.sa_sigaction = segv_handler;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+
+    if (sigaction(SIGSEGV, &sa, &old_segv) < 0)
+      return -1;
+  }
+
+  /* base last: the handler only looks at slots with a base. */
+  ranges[i].size = size;
+  ranges[i].fn = fn;
+  ranges[i].arg = arg;
+  ranges[i].base = base;
+  nranges += 1;
+
+  return 0;
+}
+
+void sd_unregister(void *base) {
+  int i;
+
+  for (i = 0; i < MAX_RANGES; ++i) {
+    if (ranges[i].base == base) {
+      ranges[i].base = NULL;
+      if (--nranges == 0)
+        sigaction(SIGSEGV, &old_segv, NULL);
+      return;
+    }
+  }
+}
@@ -0,0 +1,27 @@
+#ifndef segvdispatch_h
+#define segvdispatch_h
+
+#include <stddef.h>
+
+/* One SIGSEGV handler shared by every library in the process that takes
+ * faults on its own address ranges (lazymem, dirtytrack).
+ *
+ * The handler is installed when the first range is registered and the
+ * previous action is restored when the last one goes away. A fault in a
+ * registered range calls that range's function; any other fault is passed
+ * on to the action that was installed before, so the libraries can be
+ * used together and with an application handler.
+ */
+
+/* sd_fault_fn: handle a fault at addr, inside the range registered with
+ * arg. Runs in the signal handler. */
+typedef void (*sd_fault_fn)(void *addr, void *arg);
+
+/* sd_register: route faults in [base, base + size) to fn. Returns 0, or -1
+ * with errno set (ENOMEM when the table is full). */
+int sd_register(void *base, size_t size, sd_fault_fn fn, void *arg);
+
+/* sd_unregister: forget the range starting at base. */
+void sd_unregister(void *base);
+
+#endif
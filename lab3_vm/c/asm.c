@@ -0,0 +1,411 @@
+#include "isa.h"
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Two pass assembler for the lab3 machine.
+ *
+ * Accepts everything the simulator's text loader accepts, and in addition:
+ *
+ *   name:                  define a label at the current address
+ *   op    a,b,expr         any operand may be a number, a symbol, or
+ *                          symbol+number / symbol-number
+ *   .equ  name,expr        define a constant
+ *   .word expr[,expr...]   emit data words
+ *   .space n               emit n zero words
+ *   .org  addr             pad with zero words up to addr
+ *   .entry expr            first instruction to execute (default 0)
+ *
+ * Comments start with ';'. The output is the binary image described in isa.h.
+ */
+
+#define MAXSYM (32)       /* max length of a symbol name. */
+#define SYMTAB_SIZE (1024) /* must be a power of two. */
+
+typedef struct {
+  char name[MAXSYM + 1];
+  int value;
+  bool defined;
+} symbol_t;
+
+static symbol_t symtab[SYMTAB_SIZE];
+static unsigned nsymbols;
+
+static char *file;  /* name of the source file. */
+static int lineno;  /* current source line. */
+static int pass;    /* 1 collects labels, 2 emits code. */
+
+static unsigned *words; /* assembled program. */
+static unsigned nwords; /* current address. */
+static unsigned maxwords;
+static unsigned entry;
+
+void error(char *fmt, ...) {
+  va_list ap;
+
+  fprintf(stderr, "%s:%d: error: ", file, lineno);
+
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+
+  fputc('\n', stderr);
+  exit(1);
+}
+
+static unsigned hash(const char *s) {
+  unsigned h = 5381;
+
+  while (*s)
+    h = h * 33 + (unsigned char)*s++;
+
+  return h;
+}
+
+/* lookup: find the symbol name, creating an undefined entry if missing. */
+static symbol_t *lookup(const char *name) {
+  unsigned i;
+
+  if (strlen(name) > MAXSYM)
+    error("symbol too long: %s", name);
+
+  for (i = hash(name) & (SYMTAB_SIZE - 1);; i = (i + 1) & (SYMTAB_SIZE - 1)) {
+    if (symtab[i].name[0] == 0) {
+      if (nsymbols + 1 == SYMTAB_SIZE)
+        error("too many symbols");
+      nsymbols += 1;
+      strcpy(symtab[i].name, name);
+      return &symtab[i];
+    }
+    if (strcmp(symtab[i].name, name) == 0)
+      return &symtab[i];
+  }
+}
+
+static void define(const char *name, int value, bool label) {
+  symbol_t *sym;
+
+  sym = lookup(name);
+
+  /* Labels are defined again with the same value in pass 2. */
+  if (label && pass == 1 && sym->defined)
+    error("label %s defined twice", name);
+
+  sym->value = value;
+  sym->defined = true;
+}
+
+static void emit(unsigned word) {
+  if (pass == 2) {
+    if (nwords == maxwords) {
+      maxwords = maxwords ? 2 * maxwords : 1024;
+      words = realloc(words, maxwords * sizeof words[0]);
+      if (words == NULL)
+        error("out of memory");
+    }
+    words[nwords] = word;
+  }
+
+  nwords += 1;
+}
+
+static char *skip_space(char *s) {
+  while (*s == ' ' || *s == '\t')
+    s++;
+  return s;
+}
+
+static bool is_symbol_start(char c) {
+  return isalpha((unsigned char)c) || c == '_' || c == '.';
+}
+
+static bool is_symbol_char(char c) {
+  return isalnum((unsigned char)c) || c == '_' || c == '.';
+}
+
+/* read_symbol: copy the symbol at *s into name and advance *s past it. */
+static void read_symbol(char **s, char name[MAXSYM + 1]) {
+  char *p;
+  size_t n;
+
+  p = *s;
+  while (is_symbol_char(*p))
+    p++;
+
+  n = p - *s;
+  if (n > MAXSYM)
+    error("symbol too long");
+
+  memcpy(name, *s, n);
+  name[n] = 0;
+  *s = p;
+}
+
+/* term: number or symbol. In pass 1 undefined symbols are zero unless the
+ * value is needed right away (strict). */
+static int term(char **s, bool strict) {
+  char name[MAXSYM + 1];
+  symbol_t *sym;
+  char *end;
+  long value;
+
+  *s = skip_space(*s);
+
+  if (is_symbol_start(**s)) {
+    read_symbol(s, name);
+    sym = lookup(name);
+    if (!sym->defined && (pass == 2 || strict))
+      error("undefined symbol %s", name);
+    return sym->value;
+  }
+
+  value = strtol(*s, &end, 0);
+  if (end == *s)
+    error("expected number or symbol near \"%s\"", *s);
+  *s = end;
+
+  return value;
+}
+
+/* expr: term { (+|-) term } */
+static int expr(char **s, bool strict) {
+  int value;
+  char op;
+
+  value = term(s, strict);
+
+  for (;;) {
+    *s = skip_space(*s);
+    op = **s;
+    if (op != '+' && op != '-')
+      return value;
+    *s += 1;
+    if (op == '+')
+      value += term(s, strict);
+    else
+      value -= term(s, strict);
+  }
+}
+
+static void expect_comma(char **s) {
+  *s = skip_space(*s);
+  if (**s != ',')
+    error("expected ',' near \"%s\"", *s);
+  *s += 1;
+}
+
+static void expect_end(char *s) {
+  s = skip_space(s);
+  if (*s != 0)
+    error("junk at end of line: \"%s\"", s);
+}
+
+static int opcode_of(const char *text) {
+  unsigned i;
+
+  for (i = 0; i < NMNEMONICS; ++i)
+    if (strcmp(text, mnemonics[i]) == 0)
+      return i;
+
+  return -1;
+}
+
+static void check_register(int r) {
+  if (r < 0 || r > 31)
+    error("no such register: %d", r);
+}
+
+static void directive(char *name, char *s) {
+  char sym[MAXSYM + 1];
+  int value;
+
+  if (strcmp(name, ".word") == 0) {
+    for (;;) {
+      emit(expr(&s, false));
+      s = skip_space(s);
+      if (*s != ',')
+        break;
+      s += 1;
+    }
+  } else if (strcmp(name, ".space") == 0) {
+    value = expr(&s, true);
+    if (value < 0)
+      error("negative .space");
+    while (value-- > 0)
+      emit(0);
+  } else if (strcmp(name, ".org") == 0) {
+    value = expr(&s, true);
+    if (value < (int)nwords)
+      error(".org %d is behind current address %u", value, nwords);
+    while (nwords < (unsigned)value)
+      emit(0);
+  } else if (strcmp(name, ".equ") == 0) {
+    s = skip_space(s);
+    if (!is_symbol_start(*s))
+      error("expected symbol after .equ");
+    read_symbol(&s, sym);
+    expect_comma(&s);
+    define(sym, expr(&s, true), false);
+  } else if (strcmp(name, ".entry") == 0) {
+    entry = expr(&s, false);
+  } else
+    error("unknown directive %s", name);
+
+  expect_end(s);
+}
+
+static void instruction(char *name, char *s) {
+  int opcode;
+  int a, b, c;
+
+  opcode = opcode_of(name);
+  if (opcode < 0)
+    error("unknown instruction %s", name);
+
+  a = expr(&s, false);
+  expect_comma(&s);
+  b = expr(&s, false);
+  expect_comma(&s);
+  c = expr(&s, false);
+  expect_end(s);
+
+  if (pass == 2) {
+    check_register(a);
+    check_register(b);
+    if (c < -32768 || c > 65535)
+      error("constant %d does not fit in 16 bits", c);
+  }
+
+  emit(make_instr(opcode, a, b, c));
+}
+
+static void assemble_line(char *s) {
+  char name[MAXSYM + 1];
+  char *comment;
+
+  comment = strchr(s, ';');
+  if (comment != NULL)
+    *comment = 0;
+  s[strcspn(s, "\r\n")] = 0;
+
+  for (;;) {
+    s = skip_space(s);
+    if (*s == 0)
+      return;
+
+    if (!is_symbol_start(*s))
+      error("syntax error near \"%s\"", s);
+
+    read_symbol(&s, name);
+
+    if (*s != ':')
+      break;
+
+    /* A label, possibly followed by more on the same line. */
+    define(name, nwords, true);
+    s += 1;
+  }
+
+  if (name[0] == '.')
+    directive(name, s);
+  else
+    instruction(name, s);
+}
+
+static void assemble(FILE *in) {
+  char buf[BUFSIZ];
+
+  for (pass = 1; pass <= 2; ++pass) {
+    rewind(in);
+    nwords = 0;
+    lineno = 0;
+    entry = 0;
+
+    while (fgets(buf, sizeof buf, in) != NULL) {
+      lineno += 1;
+      assemble_line(buf);
+    }
+  }
+}
+
+static void write_image(char *out) {
+  FILE *f;
+  image_trailer_t trailer;
+
+  trailer.magic = IMAGE_MAGIC;
+  trailer.version = IMAGE_VERSION;
+  trailer.nwords = nwords;
+  trailer.entry = entry;
+
+  f = fopen(out, "wb");
+  if (f == NULL) {
+    perror(out);
+    exit(1);
+  }
+
+  if (fwrite(words, sizeof words[0], nwords, f) != nwords ||
+      fwrite(&trailer, sizeof trailer, 1, f) != 1 || fclose(f) != 0) {
+    perror(out);
+    exit(1);
+  }
+}
+
+/* default_output: foo.s -> foo.img */
+static char *default_output(char *in) {
+  char *out;
+  char *dot;
+
+  out = malloc(strlen(in) + sizeof ".img");
+  if (out == NULL)
+    error("out of memory");
+
+  strcpy(out, in);
+  dot = strrchr(out, '.');
+  if (dot != NULL && strchr(dot, '/') == NULL)
+    *dot = 0;
+  strcat(out, ".img");
+
+  return out;
+}
+
+int main(int argc, char **argv) {
+  FILE *in;
+  char *out;
+  int i;
+
+  out = NULL;
+  file = NULL;
+
+  for (i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-o") && i + 1 < argc)
+      out = argv[++i];
+    else
+      file = argv[i];
+  }
+
+  if (file == NULL) {
+    fprintf(stderr, "usage: %s [-o out.img] file.s\n", argv[0]);
+    return 1;
+  }
+
+  in = fopen(file, "r");
+  if (in == NULL) {
+    perror(file);
+    return 1;
+  }
+
+  assemble(in);
+  fclose(in);
+
+  if (out == NULL)
+    out = default_output(file);
+
+  write_image(out);
+
+  printf("%s: %u words, entry %u\n", out, nwords, entry);
+
+  return 0;
+}
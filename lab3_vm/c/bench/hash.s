@@ -0,0 +1,52 @@
+; Hash table build with chaining. INSERTS pseudo random keys below KEYS
+; are counted in a table of NBUCKETS list heads; nodes are three words
+; (key, count, next) allocated from NODES upwards.
+;
+; R2 inserts done, R3 key, R5 bucket, R6 node, R12 next free node.
+        .equ TABLE, 2048
+        .equ NBUCKETS, 256
+        .equ NODES, 2304
+        .equ KEYS, 1024
+        .equ INSERTS, 2048
+        .equ SEED, 77
+
+start:  addi    2,0,0
+        addi    3,0,SEED
+        addi    12,0,NODES
+        addi    13,0,KEYS
+        addi    14,0,NBUCKETS
+        addi    15,0,INSERTS
+        addi    16,0,5
+next:   mul     3,3,16          ; key = (5 key + 1) mod KEYS
+        addi    3,3,1
+kmod:   sge     4,3,13
+        bf      0,4,hash
+        sub     3,3,13
+        ba      0,0,kmod
+hash:   add     5,0,3           ; bucket = key mod NBUCKETS
+bmod:   sge     4,5,14
+        bf      0,4,find
+        sub     5,5,14
+        ba      0,0,bmod
+find:   ld      6,5,TABLE
+search: bf      0,6,insert      ; end of chain
+        ld      7,6,0
+        seq     4,7,3
+        bt      0,4,found
+        ld      6,6,2
+        ba      0,0,search
+found:  ld      7,6,1           ; count += 1
+        addi    7,7,1
+        st      7,6,1
+        ba      0,0,done
+insert: st      3,12,0          ; new node at the head of the chain
+        addi    7,0,1
+        st      7,12,1
+        ld      7,5,TABLE
+        st      7,12,2
+        st      12,5,TABLE
+        addi    12,12,3
+done:   addi    2,2,1
+        sgt     4,15,2
+        bt      0,4,next
+        halt    0,0,0
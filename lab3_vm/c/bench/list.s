@@ -0,0 +1,38 @@
+; Linked list traversal. N two word nodes (value, next) are linked in
+; the order 0, STEP, 2*STEP, ... (mod N) so neighbours in the list are
+; far apart in memory. The list is then walked PASSES times.
+;
+; R2 k, R3 p, R4 q, R8 N, R9 passes left, R10 sum.
+        .equ N, 1024
+        .equ NODES, 2048
+        .equ STEP, 37
+        .equ PASSES, 4
+
+start:  addi    2,0,0
+        addi    3,0,0
+        addi    8,0,N
+build:  addi    4,3,STEP        ; q = (p + STEP) mod N
+        sge     5,4,8
+        bf      0,5,link
+        sub     4,4,8
+link:   add     6,3,3           ; R6 = 2p
+        add     7,4,4
+        addi    7,7,NODES       ; R7 = &node[q]
+        st      2,6,NODES       ; node[p].value = k
+        st      7,6,NODES+1     ; node[p].next = &node[q]
+        add     3,0,4
+        addi    2,2,1
+        sgt     5,8,2
+        bt      0,5,build
+        st      0,6,NODES+1     ; last node: next = nil
+;
+        addi    10,0,0
+        addi    9,0,PASSES
+pass:   addi    3,0,NODES
+walk:   ld      11,3,0
+        add     10,10,11
+        ld      3,3,1
+        bt      0,3,walk
+        subi    9,9,1
+        bt      0,9,pass
+        halt    0,0,0
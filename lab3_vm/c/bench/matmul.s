@@ -0,0 +1,44 @@
+; Matrix multiply: C = A * B for N x N matrices stored row major.
+; The column walk over B touches a new page on almost every load.
+;
+; R2 i, R3 j, R4 k, R5 sum, R6 N, R7 address, R8 N*N.
+        .equ N, 24
+        .equ A, 2048
+        .equ B, 2624            ; A + N*N
+        .equ C, 3200            ; B + N*N
+
+start:  addi    6,0,N
+        mul     8,6,6
+        addi    2,0,0           ; A[x] = x, B[x] = x + 1
+init:   st      2,2,A
+        addi    9,2,1
+        st      9,2,B
+        addi    2,2,1
+        sgt     4,8,2
+        bt      0,4,init
+;
+        addi    2,0,0
+iloop:  addi    3,0,0
+jloop:  addi    5,0,0
+        addi    4,0,0
+kloop:  mul     7,2,6           ; A[i][k]
+        add     7,7,4
+        ld      9,7,A
+        mul     7,4,6           ; B[k][j]
+        add     7,7,3
+        ld      10,7,B
+        mul     9,9,10
+        add     5,5,9
+        addi    4,4,1
+        sgt     11,6,4          ; k < N
+        bt      0,11,kloop
+        mul     7,2,6           ; C[i][j] = sum
+        add     7,7,3
+        st      5,7,C
+        addi    3,3,1
+        sgt     11,6,3
+        bt      0,11,jloop
+        addi    2,2,1
+        sgt     11,6,2
+        bt      0,11,iloop
+        halt    0,0,0
@@ -0,0 +1,64 @@
+; Recursive quicksort (Lomuto partition) of N pseudo random words.
+; R1 is the stack pointer, R31 the return address.
+        .equ N, 1024
+        .equ ARRAY, 2048
+        .equ MOD, 4096
+        .equ SEED, 1234
+
+start:  addi    1,0,8000
+        addi    2,0,0           ; i
+        addi    5,0,SEED        ; x
+        addi    6,0,MOD
+        addi    8,0,N
+fill:   addi    7,0,5           ; x = (5x + 1) mod MOD
+        mul     5,5,7
+        addi    5,5,1
+mod:    sge     4,5,6
+        bf      0,4,store
+        sub     5,5,6
+        ba      0,0,mod
+store:  st      5,2,ARRAY
+        addi    2,2,1
+        sgt     4,8,2
+        bt      0,4,fill
+;
+        addi    3,0,0
+        addi    4,0,N-1
+        call    0,0,qsort
+        halt    0,0,0
+;
+; function QSORT: sorts ARRAY[R3..R4] in place. Clobbers R5-R10.
+;
+qsort:  sge     5,3,4           ; nothing to do if lo >= hi
+        bf      0,5,part
+        jmp     0,31,0
+part:   st      31,1,-1         ; save return address
+        st      4,1,-2          ; save hi
+        subi    1,1,3
+        ld      6,4,ARRAY       ; pivot = a[hi]
+        add     7,0,3           ; i = lo
+        add     8,0,3           ; j = lo
+ploop:  sgt     5,4,8           ; while j < hi
+        bf      0,5,pdone
+        ld      9,8,ARRAY
+        sgt     5,6,9           ; if a[j] < pivot swap a[i], a[j]
+        bf      0,5,pnext
+        ld      10,7,ARRAY
+        st      9,7,ARRAY
+        st      10,8,ARRAY
+        addi    7,7,1
+pnext:  addi    8,8,1
+        ba      0,0,ploop
+pdone:  ld      10,7,ARRAY      ; swap a[i], a[hi]
+        st      6,7,ARRAY
+        st      10,4,ARRAY
+        st      7,1,0           ; save i
+        subi    4,7,1           ; qsort(lo, i - 1)
+        call    0,0,qsort
+        ld      7,1,0
+        addi    3,7,1           ; qsort(i + 1, hi)
+        ld      4,1,1
+        call    0,0,qsort
+        addi    1,1,3
+        ld      31,1,-1
+        jmp     0,31,0
@@ -0,0 +1,31 @@
+; Strided scan: sum an array visiting every STRIDE'th word, STRIDE times
+; per pass, so consecutive loads almost always land on different pages.
+;
+; R2 index, R3 N, R5 passes left, R6 start offset, R10 sum.
+        .equ ARRAY, 2048
+        .equ N, 4096
+        .equ STRIDE, 17
+        .equ PASSES, 8
+
+start:  addi    3,0,N
+        addi    2,0,0           ; a[i] = i
+init:   st      2,2,ARRAY
+        addi    2,2,1
+        sgt     4,3,2           ; R4 = N > i
+        bt      0,4,init
+;
+        addi    10,0,0
+        addi    5,0,PASSES
+pass:   addi    6,0,0
+outer:  add     2,0,6           ; i = start
+inner:  ld      7,2,ARRAY
+        add     10,10,7
+        addi    2,2,STRIDE
+        sgt     4,3,2
+        bt      0,4,inner
+        addi    6,6,1
+        seqi    4,6,STRIDE
+        bf      0,4,outer
+        subi    5,5,1
+        bt      0,5,pass
+        halt    0,0,0
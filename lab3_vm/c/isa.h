@@ -0,0 +1,66 @@
+#ifndef isa_h
+#define isa_h
+
+/* Instruction set shared by the simulator (machine.c) and the assembler
+ * (asm.c).
+ *
+ * An instruction is one 32 bit word:
+ *
+ *   31    26 25  21 20  16 15              0
+ *  | opcode | dest | src1 |    constant     |
+ *
+ * The constant is sign extended. For instructions with two register
+ * operands the low five bits of the constant name the second register.
+ */
+
+#define ADD (0)
+#define ADDI (1)
+#define SUB (2)
+#define SUBI (3)
+#define SGE (4)
+#define SGT (5)
+#define SEQ (6)
+#define BT (7)
+#define BF (8)
+#define BA (9)
+#define ST (10)
+#define LD (11)
+#define CALL (12)
+#define JMP (13)
+#define MUL (14)
+#define SEQI (15)
+#define HALT (16)
+
+static char *mnemonics[] = {
+    [ADD] = "add",   [ADDI] = "addi", [SUB] = "sub", [SUBI] = "subi",
+    [SGE] = "sge",   [SGT] = "sgt",   [SEQ] = "seq", [SEQI] = "seqi",
+    [BT] = "bt",     [BF] = "bf",     [BA] = "ba",   [ST] = "st",
+    [LD] = "ld",     [CALL] = "call", [JMP] = "jmp", [MUL] = "mul",
+    [HALT] = "halt",
+};
+
+#define NMNEMONICS (sizeof mnemonics / sizeof mnemonics[0])
+
+static unsigned make_instr(unsigned opcode, unsigned dest, unsigned s1,
+                           unsigned s2) {
+  return (opcode << 26) | (dest << 21) | (s1 << 16) | (s2 & 0xffff);
+}
+
+/* Binary program image written by the assembler.
+ *
+ * The file holds the program words, starting at virtual address 0, followed
+ * by a trailer. Keeping the header at the end lets the simulator map the file
+ * directly over its swap area: word i of the file is word i of swap.
+ */
+
+#define IMAGE_MAGIC (0x4d49564c) /* "LVIM" little endian. */
+#define IMAGE_VERSION (1)
+
+typedef struct {
+  unsigned magic;   /* IMAGE_MAGIC. */
+  unsigned version; /* IMAGE_VERSION. */
+  unsigned nwords;  /* Number of words before the trailer. */
+  unsigned entry;   /* Address of the first instruction to execute. */
+} image_trailer_t;
+
+#endif
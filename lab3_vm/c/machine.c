@@ -1,47 +1,31 @@
+#define _DEFAULT_SOURCE
+#include "isa.h"
 #include <assert.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #define NREG (32)
 #define PAGESIZE_WIDTH (2)
 #define PAGESIZE (1 << PAGESIZE_WIDTH)
 #define NPAGES (2048)
-#define RAM_PAGES (8)
-#define RAM_SIZE (RAM_PAGES * PAGESIZE)
-#define SWAP_PAGES (128)
+#define RAM_PAGES (8) /* Default, see --ram. */
+#define MAX_RAM_PAGES (NPAGES)
+#define SWAP_PAGES (NPAGES) /* Every virtual page can own a swap page. */
 #define SWAP_SIZE (SWAP_PAGES * PAGESIZE)
 #undef DEBUG
 
-#define ADD (0)
-#define ADDI (1)
-#define SUB (2)
-#define SUBI (3)
-#define SGE (4)
-#define SGT (5)
-#define SEQ (6)
-#define BT (7)
-#define BF (8)
-#define BA (9)
-#define ST (10)
-#define LD (11)
-#define CALL (12)
-#define JMP (13)
-#define MUL (14)
-#define SEQI (15)
-#define HALT (16)
-
-char *mnemonics[] = {
-    [ADD] = "add",   [ADDI] = "addi", [SUB] = "sub", [SUBI] = "subi",
-    [SGE] = "sge",   [SGT] = "sgt",   [SEQ] = "seq", [SEQI] = "seqi",
-    [BT] = "bt",     [BF] = "bf",     [BA] = "ba",   [ST] = "st",
-    [LD] = "ld",     [CALL] = "call", [JMP] = "jmp", [MUL] = "mul",
-    [HALT] = "halt",
-};
-
 typedef struct {
   unsigned pc;        /* Program counter. */
   unsigned reg[NREG]; /* Registers. */
@@ -62,17 +46,116 @@ typedef struct {
 } coremap_entry_t;
 
 static unsigned long long num_pagefault;      /* Statistics. */
+static unsigned long long num_writeback;      /* Statistics. */
+static unsigned long long num_instr;          /* Statistics. */
 static page_table_entry_t page_table[NPAGES]; /* OS data structure. */
-static coremap_entry_t coremap[RAM_PAGES];    /* OS data structure. */
-static unsigned memory[RAM_SIZE];             /* Hardware: RAM. */
-static unsigned swap[SWAP_SIZE];              /* Hardware: disk. */
+static coremap_entry_t *coremap;              /* OS data structure. */
+static unsigned *memory;                      /* Hardware: RAM. */
+static unsigned ram_pages = RAM_PAGES;        /* Size of memory. */
+static unsigned *swap;                        /* Hardware: disk. */
+static unsigned num_swap_pages;               /* Swap pages in use. */
 static unsigned (*replace)(void);             /* Page repl. alg. */
+static char *policy_name;                     /* Name of replace. */
+static bool quiet;                            /* No execution trace. */
+static bool stats;                            /* Print a CSV stats line. */
+static unsigned fifo_next;                    /* Oldest page in memory. */
+static unsigned clock_hand;                   /* Second chance hand. */
 
-int x;
+/* Cost model (--perf): simulated cycles per event, see --cost=FILE. */
+typedef struct {
+  unsigned alu;         /* add, sub, compares and immediate forms. */
+  unsigned mul;         /* mul. */
+  unsigned branch;      /* bt, bf, ba, call, jmp, halt. */
+  unsigned load;        /* ld, on top of address translation. */
+  unsigned store;       /* st, on top of address translation. */
+  unsigned tlb_miss;    /* Page table walk. */
+  unsigned minor_fault; /* Fault on a page never written to swap. */
+  unsigned major_fault; /* Fault reading the page back from swap. */
+  unsigned writeback;   /* Writing a modified page to swap. */
+  unsigned tlb_entries; /* Direct mapped TLB size. */
+} cost_model_t;
 
-unsigned make_instr(unsigned opcode, unsigned dest, unsigned s1, unsigned s2) {
-  return (opcode << 26) | (dest << 21) | (s1 << 16) | (s2 & 0xffff);
-}
+typedef struct {
+  unsigned long long loads;
+  unsigned long long stores;
+  unsigned long long tlb_misses;
+  unsigned long long minor_faults;
+  unsigned long long major_faults;
+  unsigned long long cycles;
+} perf_count_t;
+
+static cost_model_t cost = {
+    .alu = 1,
+    .mul = 3,
+    .branch = 1,
+    .load = 2,
+    .store = 2,
+    .tlb_miss = 20,
+    .minor_fault = 2000,
+    .major_fault = 100000,
+    .writeback = 100000,
+    .tlb_entries = 16,
+};
+
+static bool perf;                          /* --perf given. */
+static char *perf_json;                    /* --perf-json file, or NULL. */
+static perf_count_t perf_count;            /* Counters. */
+static unsigned op_cycles[NMNEMONICS];     /* Cycles per opcode. */
+static unsigned *tlb;                      /* Virtual page per entry. */
+
+/* Checkpoints: the whole machine and OS state, written by --checkpoint-at
+ * or SIGUSR1 and read back by --restore. */
+#define CHECKPOINT_MAGIC (0x4b43564c) /* "LVCK" little endian. */
+#define CHECKPOINT_VERSION (1)
+
+typedef struct {
+  unsigned magic;
+  unsigned version;
+  unsigned pagesize;
+  unsigned npages;
+  unsigned ram_pages;
+  unsigned swap_pages;  /* Swap pages in use, saved after the header. */
+  unsigned fifo_next;
+  unsigned clock_hand;
+  unsigned long long instr; /* Instructions executed before the snapshot. */
+} checkpoint_header_t;
+
+static char *checkpoint_file;                 /* Where to write. */
+static unsigned long long checkpoint_at;      /* Instruction count, or 0. */
+static char *restore_file;                    /* Resume from here. */
+static volatile sig_atomic_t checkpoint_requested; /* SIGUSR1 seen. */
+
+/* Profiling: flat counters indexed by program counter and virtual page. */
+#define MAX_ADDR (NPAGES * PAGESIZE)
+#define MAX_CALL_DEPTH (4096)
+
+typedef struct {
+  unsigned long long exec;  /* Times executed. */
+  unsigned long long load;  /* Data loads issued. */
+  unsigned long long store; /* Data stores issued. */
+  unsigned long long fault; /* Page faults caused. */
+} prof_count_t;
+
+typedef struct {
+  unsigned parent;          /* Calling stack node. */
+  unsigned func;            /* Entry address of the called function. */
+  unsigned long long count; /* Instructions executed in this stack. */
+} prof_node_t;
+
+static bool profiling;                      /* --profile given. */
+static char *prof_prefix;                   /* Output file prefix. */
+static unsigned prof_pc;                    /* Instruction being executed. */
+static prof_count_t prof_pc_count[MAX_ADDR]; /* Per program counter. */
+static prof_count_t prof_page_count[NPAGES]; /* Per virtual page. */
+static prof_node_t *prof_node;              /* Call stack tree, 0 is root. */
+static unsigned prof_nnodes;
+static unsigned prof_maxnodes;
+static unsigned *prof_node_hash; /* (parent, func) -> node + 1. */
+static unsigned prof_stack;      /* Current call stack node. */
+static unsigned prof_ret[MAX_CALL_DEPTH]; /* Return address per frame. */
+static unsigned prof_depth;
+
+int x;
 
 unsigned extract_opcode(unsigned instr) { return instr >> 26; }
 
@@ -92,6 +175,11 @@ void error(char *fmt, ...) {
   exit(1);
 }
 
+static void trace(char *s) {
+  if (!quiet)
+    puts(s);
+}
+
 static void read_page(unsigned phys_page, unsigned swap_page) {
   memcpy(&memory[phys_page * PAGESIZE], &swap[swap_page * PAGESIZE],
          PAGESIZE * sizeof(unsigned));
@@ -103,49 +191,107 @@ static void write_page(unsigned phys_page, unsigned swap_page) {
 }
 
 static unsigned new_swap_page() {
-  static int count;
+  assert(num_swap_pages < SWAP_PAGES);
 
-  assert(count < SWAP_PAGES);
-
-  return count++;
+  return num_swap_pages++;
 }
 
 static unsigned fifo_page_replace() {
   int page;
 
-  page = INT_MAX;
+  page = fifo_next;
+  fifo_next = (fifo_next + 1) % ram_pages;
 
-  assert(page < RAM_PAGES);
-  /* TO COMPLETE */
+  assert(page < ram_pages);
   return page;
 }
 
 static unsigned second_chance_replace() {
+  page_table_entry_t *owner;
   int page;
 
-  page = INT_MAX;
+  for (;;) {
+    page = clock_hand;
+    clock_hand = (clock_hand + 1) % ram_pages;
+
+    owner = coremap[page].owner;
+
+    if (owner == NULL || !owner->referenced)
+      break;
+
+    owner->referenced = 0;
+  }
 
-  assert(page < RAM_PAGES);
-  /* TO COMPLETE */
+  assert(page < ram_pages);
   return page;
 }
 
-/* TO COPLETE */
 static unsigned take_phys_page() {
   unsigned page; /* Page to be replaced. */
+  page_table_entry_t *owner;
 
   page = (*replace)();
+  owner = coremap[page].owner;
+
+  if (owner != NULL) {
+    if (owner->modified) {
+      num_writeback += 1;
+      write_page(page, coremap[page].page);
+      if (perf)
+        perf_count.cycles += cost.writeback;
+    }
+
+    if (perf && tlb[(owner - page_table) % cost.tlb_entries] ==
+                    owner - page_table)
+      tlb[(owner - page_table) % cost.tlb_entries] = UINT_MAX;
+
+    owner->page = coremap[page].page;
+    owner->inmemory = 0;
+    owner->modified = 0;
+    owner->referenced = 0;
+    coremap[page].owner = NULL;
+  }
 
   return page;
 }
 
 static void pagefault(unsigned virt_page) {
   unsigned page;
+  page_table_entry_t *pte;
 
   num_pagefault += 1;
 
+  if (profiling) {
+    prof_pc_count[prof_pc].fault += 1;
+    prof_page_count[virt_page].fault += 1;
+  }
+
   page = take_phys_page();
-  /* TO COMPLETE */
+  pte = &page_table[virt_page];
+
+  if (perf) {
+    if (pte->ondisk) {
+      perf_count.major_faults += 1;
+      perf_count.cycles += cost.major_fault;
+    } else {
+      perf_count.minor_faults += 1;
+      perf_count.cycles += cost.minor_fault;
+    }
+  }
+
+  /* First touch: give the page a zero filled swap page. */
+  if (!pte->ondisk) {
+    pte->page = new_swap_page();
+    pte->ondisk = 1;
+  }
+
+  read_page(page, pte->page);
+
+  coremap[page].owner = pte;
+  coremap[page].page = pte->page;
+
+  pte->page = page;
+  pte->inmemory = 1;
 }
 
 static void translate(unsigned virt_addr, unsigned *phys_addr, bool write) {
@@ -155,6 +301,15 @@ static void translate(unsigned virt_addr, unsigned *phys_addr, bool write) {
   virt_page = virt_addr / PAGESIZE;
   offset = virt_addr & (PAGESIZE - 1);
 
+  if (virt_page >= NPAGES)
+    error("address %u out of range", virt_addr);
+
+  if (perf && tlb[virt_page % cost.tlb_entries] != virt_page) {
+    perf_count.tlb_misses += 1;
+    perf_count.cycles += cost.tlb_miss;
+    tlb[virt_page % cost.tlb_entries] = virt_page;
+  }
+
   if (!page_table[virt_page].inmemory)
     pagefault(virt_page);
 
@@ -182,19 +337,84 @@ static void write_memory(unsigned *memory, unsigned addr, unsigned data) {
   memory[phys_addr] = data;
 }
 
-void read_program(char *file, unsigned memory[], int *ninstr) {
+/* map_program: the first npages of swap hold the program. */
+static void map_program(unsigned nwords) {
+  unsigned npages;
+  unsigned i;
+
+  npages = (nwords + PAGESIZE - 1) / PAGESIZE;
+
+  if (npages > SWAP_PAGES)
+    error("program too large: %u words", nwords);
+
+  for (i = 0; i < npages; ++i) {
+    page_table[i].page = i;
+    page_table[i].ondisk = 1;
+  }
+
+  num_swap_pages = npages;
+}
+
+/* load_image: map a binary image produced by vmasm straight over swap.
+ * Returns false if file is not an image. */
+bool load_image(char *file, int *ninstr, unsigned *entry) {
+  int fd;
+  struct stat st;
+  image_trailer_t trailer;
+  size_t size;
+
+  fd = open(file, O_RDONLY);
+
+  if (fd < 0)
+    error("cannot open file");
+
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof trailer ||
+      pread(fd, &trailer, sizeof trailer, st.st_size - sizeof trailer) !=
+          sizeof trailer ||
+      trailer.magic != IMAGE_MAGIC) {
+    close(fd);
+    return false;
+  }
+
+  if (trailer.version != IMAGE_VERSION)
+    error("%s: unsupported image version %u", file, trailer.version);
+
+  size = trailer.nwords * sizeof(unsigned);
+
+  if (size + sizeof trailer != (size_t)st.st_size)
+    error("%s: corrupt image", file);
+
+  if (size > SWAP_SIZE * sizeof(unsigned))
+    error("program too large: %u words", trailer.nwords);
+
+  /* Private mapping: swap writes never reach the image file. The trailer
+   * lands after the program and is cleared. */
+  if (mmap(swap, size + sizeof trailer, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    error("cannot map %s", file);
+
+  memset(&swap[trailer.nwords], 0, sizeof trailer);
+
+  close(fd);
+
+  map_program(trailer.nwords);
+
+  *ninstr = trailer.nwords;
+  *entry = trailer.entry;
+
+  return true;
+}
+
+/* read_program: assemble a text program directly into swap. */
+void read_program(char *file, int *ninstr) {
   FILE *in;
   int opcode;
   int a, b, c;
   int i;
   char buf[BUFSIZ];
   char text[BUFSIZ];
-  int n;
   int line;
 
-  /* Find out the number of mnemonics. */
-  n = sizeof mnemonics / sizeof mnemonics[0];
-
   in = fopen(file, "r");
 
   if (in == NULL)
@@ -211,7 +431,7 @@ void read_program(char *file, unsigned memory[], int *ninstr) {
 
     opcode = -1;
 
-    for (i = 0; i < n; ++i) {
+    for (i = 0; i < NMNEMONICS; ++i) {
       if (strcmp(text, mnemonics[i]) == 0) {
         opcode = i;
         break;
@@ -221,16 +441,868 @@ void read_program(char *file, unsigned memory[], int *ninstr) {
     if (opcode < 0)
       error("syntax error near: \"%s\"", text);
 
-    write_memory(memory, line, make_instr(opcode, a, b, c));
+    if (line == SWAP_SIZE)
+      error("program too large");
+
+    swap[line] = make_instr(opcode, a, b, c);
 
     line += 1;
   }
 
+  fclose(in);
+
+  map_program(line);
+
   *ninstr = line;
 }
 
-int run(int argc, char **argv) {
-  char *file;
+/* read_cost_model: "name = cycles" lines, '#' starts a comment. */
+static void read_cost_model(char *file) {
+  static const struct {
+    char *name;
+    size_t offset;
+  } keys[] = {
+      {"alu", offsetof(cost_model_t, alu)},
+      {"mul", offsetof(cost_model_t, mul)},
+      {"branch", offsetof(cost_model_t, branch)},
+      {"load", offsetof(cost_model_t, load)},
+      {"store", offsetof(cost_model_t, store)},
+      {"tlb_miss", offsetof(cost_model_t, tlb_miss)},
+      {"minor_fault", offsetof(cost_model_t, minor_fault)},
+      {"major_fault", offsetof(cost_model_t, major_fault)},
+      {"writeback", offsetof(cost_model_t, writeback)},
+      {"tlb_entries", offsetof(cost_model_t, tlb_entries)},
+  };
+  char buf[BUFSIZ];
+  char name[BUFSIZ];
+  unsigned value;
+  unsigned i;
+  FILE *in;
+
+  in = fopen(file, "r");
+
+  if (in == NULL)
+    error("cannot open cost model %s", file);
+
+  while (fgets(buf, sizeof buf, in) != NULL) {
+    buf[strcspn(buf, "#")] = 0;
+
+    if (sscanf(buf, " %[a-z_] = %u", name, &value) != 2) {
+      if (sscanf(buf, " %s", name) == 1)
+        error("%s: syntax error near: \"%s\"", file, buf);
+      continue;
+    }
+
+    for (i = 0; i < sizeof keys / sizeof keys[0]; ++i)
+      if (strcmp(name, keys[i].name) == 0)
+        break;
+
+    if (i == sizeof keys / sizeof keys[0])
+      error("%s: unknown cost %s", file, name);
+
+    memcpy((char *)&cost + keys[i].offset, &value, sizeof value);
+  }
+
+  fclose(in);
+
+  if (cost.tlb_entries == 0)
+    error("%s: tlb_entries must be at least 1", file);
+}
+
+static void perf_init(void) {
+  unsigned i;
+
+  for (i = 0; i < NMNEMONICS; ++i)
+    op_cycles[i] = cost.alu;
+
+  op_cycles[MUL] = cost.mul;
+  op_cycles[LD] = cost.load;
+  op_cycles[ST] = cost.store;
+  op_cycles[BT] = op_cycles[BF] = op_cycles[BA] = cost.branch;
+  op_cycles[CALL] = op_cycles[JMP] = op_cycles[HALT] = cost.branch;
+
+  tlb = malloc(cost.tlb_entries * sizeof tlb[0]);
+
+  if (tlb == NULL)
+    error("out of memory");
+
+  for (i = 0; i < cost.tlb_entries; ++i)
+    tlb[i] = UINT_MAX;
+}
+
+/* perf_report: perf-stat style summary on stderr, and JSON if asked. */
+static void perf_report(char *file) {
+  unsigned long long faults;
+  double ipc;
+  FILE *f;
+
+  faults = perf_count.minor_faults + perf_count.major_faults;
+  ipc = perf_count.cycles ? (double)num_instr / perf_count.cycles : 0.0;
+
+  fprintf(stderr, "\n Performance counter stats for '%s' (%s, %u pages):\n\n",
+          file, policy_name, ram_pages);
+  fprintf(stderr, "%20llu      instructions       # %8.4f insn per cycle\n",
+          num_instr, ipc);
+  fprintf(stderr, "%20llu      cycles\n", perf_count.cycles);
+  fprintf(stderr, "%20llu      loads\n", perf_count.loads);
+  fprintf(stderr, "%20llu      stores\n", perf_count.stores);
+  fprintf(stderr, "%20llu      TLB-misses         # %8.2f%% of accesses\n",
+          perf_count.tlb_misses,
+          num_instr + perf_count.loads + perf_count.stores
+              ? 100.0 * perf_count.tlb_misses /
+                    (num_instr + perf_count.loads + perf_count.stores)
+              : 0.0);
+  fprintf(stderr, "%20llu      page-faults\n", faults);
+  fprintf(stderr, "%20llu      minor-faults\n", perf_count.minor_faults);
+  fprintf(stderr, "%20llu      major-faults\n", perf_count.major_faults);
+  fprintf(stderr, "%20llu      writebacks\n\n", num_writeback);
+
+  if (perf_json == NULL)
+    return;
+
+  f = fopen(perf_json, "w");
+
+  if (f == NULL)
+    error("cannot write %s", perf_json);
+
+  fprintf(f,
+          "{\"program\": \"%s\", \"policy\": \"%s\", \"ram_pages\": %u, "
+          "\"tlb_entries\": %u, \"instructions\": %llu, \"cycles\": %llu, "
+          "\"loads\": %llu, \"stores\": %llu, \"tlb_misses\": %llu, "
+          "\"minor_faults\": %llu, \"major_faults\": %llu, "
+          "\"writebacks\": %llu}\n",
+          file, policy_name, ram_pages, cost.tlb_entries, num_instr,
+          perf_count.cycles, perf_count.loads, perf_count.stores,
+          perf_count.tlb_misses, perf_count.minor_faults,
+          perf_count.major_faults, num_writeback);
+
+  if (fclose(f) != 0)
+    error("cannot write %s", perf_json);
+}
+
+static void on_sigusr1(int sig) { checkpoint_requested = 1; }
+
+static void write_all(FILE *f, void *p, size_t size, size_t n) {
+  if (fwrite(p, size, n, f) != n)
+    error("cannot write checkpoint %s", checkpoint_file);
+}
+
+static void read_all(FILE *f, void *p, size_t size, size_t n) {
+  if (fread(p, size, n, f) != n)
+    error("truncated checkpoint %s", restore_file);
+}
+
+/* write_checkpoint: save cpu, page table, used swap, coremap, memory and
+ * the replacement state to checkpoint_file. */
+static void write_checkpoint(cpu_t *cpu, unsigned long long instr) {
+  checkpoint_header_t h;
+  unsigned owner;
+  unsigned i;
+  FILE *f;
+
+  f = fopen(checkpoint_file, "wb");
+
+  if (f == NULL)
+    error("cannot write checkpoint %s", checkpoint_file);
+
+  h.magic = CHECKPOINT_MAGIC;
+  h.version = CHECKPOINT_VERSION;
+  h.pagesize = PAGESIZE;
+  h.npages = NPAGES;
+  h.ram_pages = ram_pages;
+  h.swap_pages = num_swap_pages;
+  h.fifo_next = fifo_next;
+  h.clock_hand = clock_hand;
+  h.instr = instr;
+
+  write_all(f, &h, sizeof h, 1);
+  write_all(f, cpu, sizeof *cpu, 1);
+  write_all(f, page_table, sizeof page_table[0], NPAGES);
+
+  write_all(f, swap, sizeof swap[0], num_swap_pages * PAGESIZE);
+
+  /* Each frame: owner as a page table index, swap page, contents. */
+  for (i = 0; i < ram_pages; ++i) {
+    owner = coremap[i].owner ? coremap[i].owner - page_table : UINT_MAX;
+    write_all(f, &owner, sizeof owner, 1);
+    write_all(f, &coremap[i].page, sizeof coremap[i].page, 1);
+    write_all(f, &memory[i * PAGESIZE], sizeof memory[0], PAGESIZE);
+  }
+
+  if (fclose(f) != 0)
+    error("cannot write checkpoint %s", checkpoint_file);
+
+  if (!quiet)
+    printf("checkpoint written to %s after %llu instructions\n",
+           checkpoint_file, instr);
+}
+
+/* restore_checkpoint: load restore_file, fitting the saved memory into
+ * ram_pages. Frames that no longer exist are written back to swap and
+ * their pages marked as not in memory. */
+static unsigned long long restore_checkpoint(cpu_t *cpu) {
+  checkpoint_header_t h;
+  unsigned owner;
+  unsigned page;
+  unsigned i;
+  FILE *f;
+
+  f = fopen(restore_file, "rb");
+
+  if (f == NULL)
+    error("cannot open checkpoint %s", restore_file);
+
+  read_all(f, &h, sizeof h, 1);
+
+  if (h.magic != CHECKPOINT_MAGIC || h.version != CHECKPOINT_VERSION)
+    error("%s is not a checkpoint", restore_file);
+
+  if (h.pagesize != PAGESIZE || h.npages != NPAGES ||
+      h.ram_pages > MAX_RAM_PAGES || h.swap_pages > SWAP_PAGES)
+    error("checkpoint %s has a different geometry", restore_file);
+
+  read_all(f, cpu, sizeof *cpu, 1);
+  read_all(f, page_table, sizeof page_table[0], NPAGES);
+
+  /* Swap comes first so that dropped frames below can overwrite it. */
+  read_all(f, swap, sizeof swap[0], h.swap_pages * PAGESIZE);
+
+  for (i = 0; i < h.ram_pages; ++i) {
+    read_all(f, &owner, sizeof owner, 1);
+    read_all(f, &page, sizeof page, 1);
+
+    if (owner != UINT_MAX && owner >= NPAGES)
+      error("corrupt checkpoint %s", restore_file);
+
+    if (i < ram_pages) {
+      coremap[i].owner = owner == UINT_MAX ? NULL : &page_table[owner];
+      coremap[i].page = page;
+      read_all(f, &memory[i * PAGESIZE], sizeof memory[0], PAGESIZE);
+    } else {
+      /* Smaller memory: this frame goes straight back to swap. */
+      read_all(f, &swap[page * PAGESIZE], sizeof swap[0], PAGESIZE);
+
+      if (owner != UINT_MAX) {
+        page_table[owner].page = page;
+        page_table[owner].inmemory = 0;
+        page_table[owner].modified = 0;
+        page_table[owner].referenced = 0;
+      }
+    }
+  }
+
+  fclose(f);
+
+  num_swap_pages = h.swap_pages;
+  fifo_next = h.fifo_next % ram_pages;
+  clock_hand = h.clock_hand % ram_pages;
+
+  return h.instr;
+}
+
+static unsigned prof_hash(unsigned parent, unsigned func) {
+  return (parent * 2654435761u ^ func * 40503u) & (2 * prof_maxnodes - 1);
+}
+
+/* prof_child: call stack node for calling func from node parent. */
+static unsigned prof_child(unsigned parent, unsigned func) {
+  unsigned h;
+  unsigned n;
+  unsigned i;
+
+  for (h = prof_hash(parent, func); prof_node_hash[h] != 0;
+       h = (h + 1) & (2 * prof_maxnodes - 1)) {
+    n = prof_node_hash[h] - 1;
+    if (prof_node[n].parent == parent && prof_node[n].func == func)
+      return n;
+  }
+
+  if (prof_nnodes == prof_maxnodes) {
+    /* Double the tree and rebuild the hash table at its new size. */
+    prof_maxnodes *= 2;
+    prof_node = realloc(prof_node, prof_maxnodes * sizeof prof_node[0]);
+    free(prof_node_hash);
+    prof_node_hash = calloc(2 * prof_maxnodes, sizeof prof_node_hash[0]);
+
+    if (prof_node == NULL || prof_node_hash == NULL)
+      error("out of memory");
+
+    for (i = 1; i < prof_nnodes; ++i) {
+      for (h = prof_hash(prof_node[i].parent, prof_node[i].func);
+           prof_node_hash[h] != 0; h = (h + 1) & (2 * prof_maxnodes - 1))
+        ;
+      prof_node_hash[h] = i + 1;
+    }
+
+    return prof_child(parent, func);
+  }
+
+  n = prof_nnodes++;
+  prof_node[n].parent = parent;
+  prof_node[n].func = func;
+  prof_node[n].count = 0;
+  prof_node_hash[h] = n + 1;
+
+  return n;
+}
+
+static void prof_init(void) {
+  prof_maxnodes = 1024;
+  prof_node = malloc(prof_maxnodes * sizeof prof_node[0]);
+  prof_node_hash = calloc(2 * prof_maxnodes, sizeof prof_node_hash[0]);
+
+  if (prof_node == NULL || prof_node_hash == NULL)
+    error("out of memory");
+
+  prof_node[0].parent = 0;
+  prof_node[0].func = 0;
+  prof_node[0].count = 0;
+  prof_nnodes = 1;
+  prof_stack = 0;
+  prof_depth = 0;
+}
+
+static void prof_call(unsigned target, unsigned ret) {
+  if (prof_depth == MAX_CALL_DEPTH)
+    return;
+
+  prof_ret[prof_depth++] = ret;
+  prof_stack = prof_child(prof_stack, target);
+}
+
+/* prof_jump: a jmp to the return address of a live frame is a return. Any
+ * other jmp leaves the stack alone. */
+static void prof_jump(unsigned target) {
+  unsigned d;
+
+  for (d = prof_depth; d > 0; --d)
+    if (prof_ret[d - 1] == target)
+      break;
+
+  if (d == 0)
+    return;
+
+  while (prof_depth >= d) {
+    prof_depth -= 1;
+    prof_stack = prof_node[prof_stack].parent;
+  }
+}
+
+static int prof_cmp_exec(const void *a, const void *b) {
+  const prof_count_t *x = &prof_pc_count[*(const unsigned *)a];
+  const prof_count_t *y = &prof_pc_count[*(const unsigned *)b];
+
+  if (x->exec != y->exec)
+    return x->exec < y->exec ? 1 : -1;
+
+  return *(const unsigned *)a < *(const unsigned *)b ? -1 : 1;
+}
+
+static int prof_cmp_fault(const void *a, const void *b) {
+  const prof_count_t *x = &prof_page_count[*(const unsigned *)a];
+  const prof_count_t *y = &prof_page_count[*(const unsigned *)b];
+
+  if (x->fault != y->fault)
+    return x->fault < y->fault ? 1 : -1;
+
+  if (x->load + x->store != y->load + y->store)
+    return x->load + x->store < y->load + y->store ? 1 : -1;
+
+  return *(const unsigned *)a < *(const unsigned *)b ? -1 : 1;
+}
+
+static FILE *prof_open(char *suffix) {
+  char name[BUFSIZ];
+  FILE *f;
+
+  snprintf(name, sizeof name, "%s%s", prof_prefix, suffix);
+
+  f = fopen(name, "w");
+
+  if (f == NULL)
+    error("cannot write %s", name);
+
+  return f;
+}
+
+/* prof_stack_name: print the folded frames of node n, outermost first. */
+static void prof_stack_name(FILE *f, unsigned n) {
+  if (n == 0) {
+    fprintf(f, "start");
+    return;
+  }
+
+  prof_stack_name(f, prof_node[n].parent);
+  fprintf(f, ";fn_%u", prof_node[n].func);
+}
+
+/* prof_report: write PREFIX.txt (hot spots) and PREFIX.folded (stacks). */
+static void prof_report(void) {
+  static unsigned order[MAX_ADDR];
+  unsigned long long total;
+  unsigned instr;
+  unsigned n;
+  unsigned i;
+  FILE *f;
+
+  f = prof_open(".txt");
+
+  total = 0;
+  n = 0;
+  for (i = 0; i < MAX_ADDR; ++i) {
+    if (prof_pc_count[i].exec == 0 && prof_pc_count[i].fault == 0)
+      continue;
+    total += prof_pc_count[i].exec;
+    order[n++] = i;
+  }
+
+  qsort(order, n, sizeof order[0], prof_cmp_exec);
+
+  fprintf(f, "# hot spots: %llu instructions, %llu page faults\n", total,
+          num_pagefault);
+  fprintf(f, "# %6s %12s %6s %10s %10s %8s  %s\n", "pc", "exec", "%", "loads",
+          "stores", "faults", "instruction");
+
+  for (i = 0; i < n; ++i) {
+    prof_count_t *c = &prof_pc_count[order[i]];
+
+    instr = swap[order[i]];
+    if (page_table[order[i] / PAGESIZE].inmemory)
+      instr = memory[page_table[order[i] / PAGESIZE].page * PAGESIZE +
+                     order[i] % PAGESIZE];
+
+    fprintf(f, "  %6u %12llu %6.2f %10llu %10llu %8llu  ", order[i], c->exec,
+            total ? 100.0 * c->exec / total : 0.0, c->load, c->store,
+            c->fault);
+
+    if (extract_opcode(instr) < NMNEMONICS)
+      fprintf(f, "%s %u,%u,%d\n", mnemonics[extract_opcode(instr)],
+              extract_dest(instr), extract_source1(instr),
+              extract_constant(instr));
+    else
+      fprintf(f, "?\n");
+  }
+
+  n = 0;
+  for (i = 0; i < NPAGES; ++i)
+    if (prof_page_count[i].load || prof_page_count[i].store ||
+        prof_page_count[i].fault)
+      order[n++] = i;
+
+  qsort(order, n, sizeof order[0], prof_cmp_fault);
+
+  fprintf(f, "\n# pages by faults\n");
+  fprintf(f, "# %6s %8s %10s %10s\n", "page", "faults", "loads", "stores");
+
+  for (i = 0; i < n; ++i)
+    fprintf(f, "  %6u %8llu %10llu %10llu\n", order[i],
+            prof_page_count[order[i]].fault, prof_page_count[order[i]].load,
+            prof_page_count[order[i]].store);
+
+  fclose(f);
+
+  f = prof_open(".folded");
+
+  for (i = 0; i < prof_nnodes; ++i) {
+    if (prof_node[i].count == 0)
+      continue;
+    prof_stack_name(f, i);
+    fprintf(f, " %llu\n", prof_node[i].count);
+  }
+
+  fclose(f);
+}
+
+/* Dynamic translation (--jit): each basic block, ending at bt, bf, ba,
+ * call, jmp or halt, is translated once into x86-64 code and cached by its
+ * start address. Instruction fetches are replayed inline against the page
+ * table, and loads and stores call back into translate(), so the page
+ * faults, referenced and modified bits are exactly those of the
+ * interpreter. A store to a page holding translated code flushes the whole
+ * cache and ends the running block. */
+
+#define JIT_MAX_BLOCK (64)             /* Instructions per block. */
+#define JIT_MAX_INSTR_BYTES (128)      /* Code per instruction, generous. */
+#define JIT_BUFSIZE (4 * 1024 * 1024)  /* Executable buffer. */
+#define JIT_HALT (1u << 31)            /* Block returned on halt. */
+
+typedef unsigned (*jit_block_t)(cpu_t *); /* Returns instructions executed. */
+
+static bool use_jit;                   /* --jit given. */
+static unsigned char *jit_buf;         /* Executable code buffer. */
+static unsigned char *jit_code;        /* Next free byte in jit_buf. */
+static jit_block_t jit_block[MAX_ADDR]; /* Translation of each start pc. */
+static bool jit_code_page[NPAGES];     /* Page has translated code. */
+static unsigned jit_inmemory_mask;     /* page_table_entry_t.inmemory. */
+static unsigned jit_referenced_mask;   /* page_table_entry_t.referenced. */
+
+static void jit_flush(void) {
+  memset(jit_block, 0, sizeof jit_block);
+  memset(jit_code_page, 0, sizeof jit_code_page);
+  jit_code = jit_buf;
+}
+
+/* Callbacks from translated code. */
+
+static void jit_fetch(unsigned addr) {
+  unsigned phys_addr;
+
+  translate(addr, &phys_addr, false);
+}
+
+static unsigned jit_load(unsigned addr) { return read_memory(memory, addr); }
+
+/* jit_store: returns nonzero if translated code was thrown away. */
+static unsigned jit_store(unsigned addr, unsigned data) {
+  write_memory(memory, addr, data);
+
+  if (!jit_code_page[addr / PAGESIZE])
+    return 0;
+
+  jit_flush();
+  return 1;
+}
+
+#if defined(__x86_64__)
+
+static void emit_byte(unsigned b) { *jit_code++ = b; }
+
+static void emit_u32(unsigned u) {
+  memcpy(jit_code, &u, sizeof u);
+  jit_code += sizeof u;
+}
+
+static void emit_u64(unsigned long long u) {
+  memcpy(jit_code, &u, sizeof u);
+  jit_code += sizeof u;
+}
+
+static unsigned reg_disp(unsigned r) {
+  return offsetof(cpu_t, reg) + r * sizeof(unsigned);
+}
+
+/* op eax, [rbx + disp32] for the one or two byte opcode given. */
+static void emit_eax_mem(unsigned op, unsigned disp) {
+  if (op > 0xff)
+    emit_byte(op >> 8);
+  emit_byte(op & 0xff);
+  emit_byte(0x83);
+  emit_u32(disp);
+}
+
+#define MOV_EAX_MEM (0x8b)
+#define MOV_MEM_EAX (0x89)
+#define ADD_EAX_MEM (0x03)
+#define SUB_EAX_MEM (0x2b)
+#define CMP_EAX_MEM (0x3b)
+#define IMUL_EAX_MEM (0x0faf)
+
+static void emit_load_reg(unsigned r) { emit_eax_mem(MOV_EAX_MEM, reg_disp(r)); }
+
+static void emit_store_reg(unsigned r) {
+  if (r != 0)
+    emit_eax_mem(MOV_MEM_EAX, reg_disp(r));
+}
+
+/* mov dword [rbx + disp32], imm32 */
+static void emit_store_imm(unsigned disp, unsigned imm) {
+  emit_byte(0xc7);
+  emit_byte(0x83);
+  emit_u32(disp);
+  emit_u32(imm);
+}
+
+static void emit_set_pc(unsigned pc) {
+  emit_store_imm(offsetof(cpu_t, pc), pc);
+}
+
+/* op eax, imm32 with op one of add (0x05), sub (0x2d), cmp (0x3d). */
+static void emit_eax_imm(unsigned op, unsigned imm) {
+  emit_byte(op);
+  emit_u32(imm);
+}
+
+/* setcc al; movzx eax, al */
+static void emit_setcc(unsigned cc) {
+  emit_byte(0x0f);
+  emit_byte(cc);
+  emit_byte(0xc0);
+  emit_byte(0x0f);
+  emit_byte(0xb6);
+  emit_byte(0xc0);
+}
+
+/* movabs rax, fn; call rax */
+static void emit_call(unsigned long long fn) {
+  emit_byte(0x48);
+  emit_byte(0xb8);
+  emit_u64(fn);
+  emit_byte(0xff);
+  emit_byte(0xd0);
+}
+
+/* mov eax, count; pop rbx; ret */
+static void emit_return(unsigned count) {
+  emit_byte(0xb8);
+  emit_u32(count);
+  emit_byte(0x5b);
+  emit_byte(0xc3);
+}
+
+/* The fetch of the instruction at pc: set referenced if the page is in
+ * memory, otherwise go through translate() and take the fault. */
+static void emit_fetch(unsigned pc) {
+  emit_byte(0x48); /* movabs rax, &page_table[pc / PAGESIZE] */
+  emit_byte(0xb8);
+  emit_u64((unsigned long long)(uintptr_t)&page_table[pc / PAGESIZE]);
+  emit_byte(0xf7); /* test dword [rax], inmemory */
+  emit_byte(0x00);
+  emit_u32(jit_inmemory_mask);
+  emit_byte(0x74); /* jz slow */
+  emit_byte(0x08);
+  emit_byte(0x81); /* or dword [rax], referenced */
+  emit_byte(0x08);
+  emit_u32(jit_referenced_mask);
+  emit_byte(0xeb); /* jmp done */
+  emit_byte(0x11);
+  emit_byte(0xbf); /* slow: mov edi, pc */
+  emit_u32(pc);
+  emit_call((unsigned long long)(uintptr_t)jit_fetch);
+}
+
+/* emit_address: eax = edi = source1 + constant */
+static void emit_address(unsigned s1, int constant) {
+  emit_load_reg(s1);
+  emit_eax_imm(0x05, constant);
+  emit_byte(0x89); /* mov edi, eax */
+  emit_byte(0xc7);
+}
+
+/* peek: instruction word at addr without touching the paging state. */
+static unsigned peek(unsigned addr) {
+  page_table_entry_t *pte;
+
+  pte = &page_table[addr / PAGESIZE];
+
+  if (pte->inmemory)
+    return memory[pte->page * PAGESIZE + addr % PAGESIZE];
+  else if (pte->ondisk)
+    return swap[pte->page * PAGESIZE + addr % PAGESIZE];
+  else
+    return 0;
+}
+
+static jit_block_t jit_translate(unsigned start) {
+  unsigned char *entry;
+  jit_block_t block;
+  unsigned pc;
+  unsigned n;
+  unsigned instr;
+  unsigned opcode;
+  unsigned dest_reg;
+  unsigned source_reg1;
+  int constant;
+  bool end;
+
+  if (jit_code + JIT_MAX_BLOCK * JIT_MAX_INSTR_BYTES > jit_buf + JIT_BUFSIZE)
+    jit_flush();
+
+  entry = jit_code;
+
+  emit_byte(0x53); /* push rbx */
+  emit_byte(0x48); /* mov rbx, rdi */
+  emit_byte(0x89);
+  emit_byte(0xfb);
+
+  end = false;
+  opcode = ADD;
+
+  for (n = 0, pc = start; !end && n < JIT_MAX_BLOCK && pc < MAX_ADDR;
+       ++n, ++pc) {
+    instr = peek(pc);
+    opcode = extract_opcode(instr);
+    dest_reg = extract_dest(instr);
+    source_reg1 = extract_source1(instr);
+    constant = extract_constant(instr);
+
+    if (opcode >= NMNEMONICS) {
+      if (n > 0)
+        break;
+      jit_fetch(pc);
+      error("illegal instruction at pc = %d: opcode = %d\n", pc, opcode);
+    }
+
+    jit_code_page[pc / PAGESIZE] = true;
+
+    emit_fetch(pc);
+
+    switch (opcode) {
+    case ADD:
+    case SUB:
+    case MUL:
+      emit_load_reg(source_reg1);
+      emit_eax_mem(opcode == ADD   ? ADD_EAX_MEM
+                   : opcode == SUB ? SUB_EAX_MEM
+                                   : IMUL_EAX_MEM,
+                   reg_disp(constant & (NREG - 1)));
+      emit_store_reg(dest_reg);
+      break;
+
+    case ADDI:
+    case SUBI:
+      emit_load_reg(source_reg1);
+      emit_eax_imm(opcode == ADDI ? 0x05 : 0x2d, constant);
+      emit_store_reg(dest_reg);
+      break;
+
+    case SGE:
+    case SGT:
+    case SEQ:
+      emit_load_reg(source_reg1);
+      emit_eax_mem(CMP_EAX_MEM, reg_disp(constant & (NREG - 1)));
+      emit_setcc(opcode == SGE ? 0x9d : opcode == SGT ? 0x9f : 0x94);
+      emit_store_reg(dest_reg);
+      break;
+
+    case SEQI:
+      emit_load_reg(source_reg1);
+      emit_eax_imm(0x3d, constant);
+      emit_setcc(0x94);
+      emit_store_reg(dest_reg);
+      break;
+
+    case BT:
+    case BF:
+      emit_set_pc(pc + 1);
+      emit_load_reg(source_reg1);
+      emit_byte(0x85); /* test eax, eax */
+      emit_byte(0xc0);
+      emit_byte(opcode == BT ? 0x74 : 0x75); /* jz / jnz over next */
+      emit_byte(0x0a);
+      emit_set_pc(constant);
+      end = true;
+      break;
+
+    case BA:
+      emit_set_pc(constant);
+      end = true;
+      break;
+
+    case LD:
+      emit_address(source_reg1, constant);
+      emit_call((unsigned long long)(uintptr_t)jit_load);
+      emit_store_reg(dest_reg);
+      break;
+
+    case ST:
+      emit_address(source_reg1, constant);
+      emit_byte(0x8b); /* mov esi, [rbx + reg] */
+      emit_byte(0xb3);
+      emit_u32(reg_disp(dest_reg));
+      emit_call((unsigned long long)(uintptr_t)jit_store);
+      emit_byte(0x85); /* test eax, eax */
+      emit_byte(0xc0);
+      emit_byte(0x74); /* jz over the exit */
+      emit_byte(0x11);
+      emit_set_pc(pc + 1);
+      emit_return(n + 1);
+      break;
+
+    case CALL:
+      emit_store_imm(reg_disp(31), pc + 1);
+      emit_set_pc(constant);
+      end = true;
+      break;
+
+    case JMP:
+      emit_load_reg(source_reg1);
+      emit_eax_mem(MOV_MEM_EAX, offsetof(cpu_t, pc));
+      end = true;
+      break;
+
+    case HALT:
+      emit_set_pc(pc);
+      emit_return((n + 1) | JIT_HALT);
+      end = true;
+      break;
+    }
+  }
+
+  if (opcode != HALT) {
+    if (!end)
+      emit_set_pc(pc);
+    emit_return(n);
+  }
+
+  memcpy(&block, &entry, sizeof block);
+  jit_block[start] = block;
+
+  return block;
+}
+
+static void jit_init(void) {
+  page_table_entry_t pte;
+
+  assert(sizeof pte == sizeof(unsigned));
+
+  jit_buf = mmap(NULL, JIT_BUFSIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (jit_buf == MAP_FAILED)
+    error("cannot allocate executable memory");
+
+  /* Bit positions of the page table flags as laid out by this compiler. */
+  memset(&pte, 0, sizeof pte);
+  pte.inmemory = 1;
+  memcpy(&jit_inmemory_mask, &pte, sizeof jit_inmemory_mask);
+
+  memset(&pte, 0, sizeof pte);
+  pte.referenced = 1;
+  memcpy(&jit_referenced_mask, &pte, sizeof jit_referenced_mask);
+
+  jit_flush();
+}
+
+/* jit_run: execute from cpu->pc until halt. */
+static void jit_run(cpu_t *cpu, unsigned long long base_instr) {
+  jit_block_t block;
+  unsigned phys_addr;
+  unsigned count;
+
+  jit_init();
+
+  for (;;) {
+    if (checkpoint_requested) {
+      write_checkpoint(cpu, base_instr + num_instr);
+      checkpoint_requested = 0;
+    }
+
+    /* Let translate() report addresses out of range. */
+    if (cpu->pc >= MAX_ADDR)
+      translate(cpu->pc, &phys_addr, false);
+
+    block = jit_block[cpu->pc];
+
+    if (block == NULL)
+      block = jit_translate(cpu->pc);
+
+    count = block(cpu);
+    num_instr += count & ~JIT_HALT;
+
+    if (count & JIT_HALT)
+      return;
+  }
+}
+
+#else
+
+static void jit_run(cpu_t *cpu, unsigned long long base_instr) {
+  error("--jit is only supported on x86-64");
+}
+
+#endif
+
+int run(char *file) {
   cpu_t cpu;
   int i;
   int j;
@@ -244,25 +1316,43 @@ int run(int argc, char **argv) {
   int source2;
   int dest;
   unsigned data;
+  unsigned entry;
+  unsigned long long base_instr; /* Executed before a restored checkpoint. */
   bool proceed;
   bool increment_pc;
   bool writeback;
 
-  if (argc > 2)
-    file = argv[2];
-  else
-    file = "a.s";
+  entry = 0;
+  base_instr = 0;
+
+  if (restore_file != NULL)
+    base_instr = restore_checkpoint(&cpu);
+  else {
+    if (!load_image(file, &ninstr, &entry))
+      read_program(file, &ninstr);
+
+    /* First instruction to execute is at the entry point, 0 by default. */
+    memset(&cpu, 0, sizeof cpu);
+    cpu.pc = entry;
+  }
 
-  read_program(file, memory, &ninstr);
+  if (profiling)
+    prof_init();
 
-  /* First instruction to execute is at address 0. */
-  cpu.pc = 0;
-  cpu.reg[0] = 0;
+  if (perf)
+    perf_init();
 
   proceed = true;
 
+  if (use_jit) {
+    jit_run(&cpu, base_instr);
+    proceed = false;
+  }
+
   while (proceed) {
 
+    prof_pc = cpu.pc;
+
     /* Fetch next instruction to execute. */
     instr = read_memory(memory, cpu.pc);
 
@@ -279,56 +1369,62 @@ int run(int argc, char **argv) {
     increment_pc = true;
     writeback = true;
 
-    printf("pc = %3d: ", cpu.pc);
+    if (profiling) {
+      prof_pc_count[cpu.pc].exec += 1;
+      prof_node[prof_stack].count += 1;
+    }
+
+    if (!quiet)
+      printf("pc = %3d: ", cpu.pc);
 
     switch (opcode) {
     case ADD:
-      puts("ADD");
+      trace("ADD");
       dest = source1 + source2;
       break;
 
     case ADDI:
-      puts("ADDI");
+      trace("ADDI");
       dest = source1 + constant;
       break;
 
     case SUB:
-      puts("SUB");
+      trace("SUB");
       dest = source1 - source2;
       break;
 
     case SUBI:
-      puts("SUBI");
+      trace("SUBI");
       dest = source1 - constant;
       break;
 
     case MUL:
-      puts("MUL");
+      trace("MUL");
       dest = source1 * source2;
       break;
 
     case SGE:
-      puts("SGE");
+      trace("SGE");
       dest = source1 >= source2;
       break;
 
     case SGT:
-      puts("SGT");
+      trace("SGT");
       dest = source1 > source2;
       break;
 
     case SEQ:
-      puts("SEQ");
+      trace("SEQ");
       dest = source1 == source2;
       break;
 
     case SEQI:
-      puts("SEQI");
+      trace("SEQI");
       dest = source1 == constant;
       break;
 
     case BT:
-      puts("BT");
+      trace("BT");
       writeback = false;
       if (source1 != 0) {
         cpu.pc = constant;
@@ -337,7 +1433,7 @@ int run(int argc, char **argv) {
       break;
 
     case BF:
-      puts("BF");
+      trace("BF");
       writeback = false;
       if (source1 == 0) {
         cpu.pc = constant;
@@ -346,42 +1442,58 @@ int run(int argc, char **argv) {
       break;
 
     case BA:
-      puts("BA");
+      trace("BA");
       writeback = false;
       increment_pc = false;
       cpu.pc = constant;
       break;
 
     case LD:
-      puts("LD");
+      trace("LD");
       data = read_memory(memory, source1 + constant);
       dest = data;
+      if (perf)
+        perf_count.loads += 1;
+      if (profiling) {
+        prof_pc_count[cpu.pc].load += 1;
+        prof_page_count[(source1 + constant) / PAGESIZE].load += 1;
+      }
       break;
 
     case ST:
-      puts("ST");
+      trace("ST");
       data = cpu.reg[dest_reg];
       write_memory(memory, source1 + constant, data);
       writeback = false;
+      if (perf)
+        perf_count.stores += 1;
+      if (profiling) {
+        prof_pc_count[cpu.pc].store += 1;
+        prof_page_count[(source1 + constant) / PAGESIZE].store += 1;
+      }
       break;
 
     case CALL:
-      puts("CALL");
+      trace("CALL");
       increment_pc = false;
       dest = cpu.pc + 1;
       dest_reg = 31;
       cpu.pc = constant;
+      if (profiling)
+        prof_call(cpu.pc, dest);
       break;
 
     case JMP:
-      puts("JMP");
+      trace("JMP");
       increment_pc = false;
       writeback = false;
       cpu.pc = source1;
+      if (profiling)
+        prof_jump(cpu.pc);
       break;
 
     case HALT:
-      puts("HALT");
+      trace("HALT");
       increment_pc = false;
       writeback = false;
       proceed = false;
@@ -394,9 +1506,25 @@ int run(int argc, char **argv) {
     if (writeback && dest_reg != 0)
       cpu.reg[dest_reg] = dest;
 
+    if (perf)
+      perf_count.cycles += op_cycles[opcode];
+
     if (increment_pc)
       cpu.pc += 1;
 
+    num_instr += 1;
+
+    if (checkpoint_requested ||
+        (checkpoint_at != 0 && num_instr == checkpoint_at)) {
+      write_checkpoint(&cpu, base_instr + num_instr);
+
+      /* A checkpoint at a given count ends the warm-up run. */
+      if (!checkpoint_requested)
+        proceed = false;
+
+      checkpoint_requested = 0;
+    }
+
 #ifdef DEBUG
     i = 0;
     while (i < NREG) {
@@ -411,7 +1539,7 @@ int run(int argc, char **argv) {
   }
 
   i = 0;
-  while (i < NREG) {
+  while (!stats && i < NREG) {
     for (j = 0; j < 4; ++j, ++i) {
       if (j > 0)
         printf("| ");
@@ -419,18 +1547,36 @@ int run(int argc, char **argv) {
     }
     printf("\n");
   }
+
+  if (profiling)
+    prof_report();
+
+  if (perf)
+    perf_report(file);
+
   return 0;
 }
 
 int main(int argc, char **argv) {
+  char *file;
+  int i;
+  struct timespec start, stop;
+  double seconds;
+
+  swap = mmap(NULL, SWAP_SIZE * sizeof(unsigned), PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (swap == MAP_FAILED)
+    error("cannot allocate swap");
+
   replace = fifo_page_replace;
   if (argc >= 2) {
     if (!strcmp(argv[1], "--second-chance")) {
       replace = second_chance_replace;
-      printf("Second change page replacement algorithm.\n");
+      policy_name = "second-chance";
     } else if (!strcmp(argv[1], "--fifo")) {
       replace = fifo_page_replace;
-      printf("FIFO page replacement algorithm.\n");
+      policy_name = "fifo";
     } else {
       printf("Unknown page replacement algorithm.\n");
       return -1;
@@ -440,7 +1586,90 @@ int main(int argc, char **argv) {
     return -1;
   }
 
-  run(argc, argv);
+  file = "a.s";
+
+  for (i = 2; i < argc; ++i) {
+    if (!strcmp(argv[i], "--profile")) {
+      profiling = true;
+      prof_prefix = "profile";
+    } else if (!strncmp(argv[i], "--profile=", 10)) {
+      profiling = true;
+      prof_prefix = argv[i] + 10;
+    } else if (!strcmp(argv[i], "--quiet")) {
+      quiet = true;
+    } else if (!strcmp(argv[i], "--stats")) {
+      stats = true;
+    } else if (!strcmp(argv[i], "--perf")) {
+      perf = true;
+    } else if (!strncmp(argv[i], "--perf-json=", 12)) {
+      perf = true;
+      perf_json = argv[i] + 12;
+    } else if (!strncmp(argv[i], "--cost=", 7)) {
+      perf = true;
+      read_cost_model(argv[i] + 7);
+    } else if (!strcmp(argv[i], "--jit")) {
+      use_jit = true;
+    } else if (!strncmp(argv[i], "--ram=", 6)) {
+      ram_pages = atoi(argv[i] + 6);
+      if (ram_pages < 1 || ram_pages > MAX_RAM_PAGES) {
+        printf("RAM size must be 1 to %d pages.\n", MAX_RAM_PAGES);
+        return -1;
+      }
+    } else if (!strncmp(argv[i], "--checkpoint=", 13)) {
+      checkpoint_file = argv[i] + 13;
+    } else if (!strncmp(argv[i], "--checkpoint-at=", 16)) {
+      checkpoint_at = strtoull(argv[i] + 16, NULL, 10);
+    } else if (!strncmp(argv[i], "--restore=", 10)) {
+      restore_file = argv[i] + 10;
+      file = restore_file;
+    } else if (!strncmp(argv[i], "--", 2)) {
+      printf("Unknown option %s.\n", argv[i]);
+      return -1;
+    } else
+      file = argv[i];
+  }
+
+  if (checkpoint_at != 0 && checkpoint_file == NULL) {
+    printf("--checkpoint-at needs --checkpoint=FILE.\n");
+    return -1;
+  }
+
+  if (use_jit && (profiling || perf || checkpoint_at != 0)) {
+    printf("--jit cannot be combined with --profile, --perf or "
+           "--checkpoint-at.\n");
+    return -1;
+  }
+
+  if (checkpoint_file != NULL)
+    signal(SIGUSR1, on_sigusr1);
+
+  memory = calloc(ram_pages * PAGESIZE, sizeof memory[0]);
+  coremap = calloc(ram_pages, sizeof coremap[0]);
+
+  if (memory == NULL || coremap == NULL)
+    error("cannot allocate memory");
+
+  if (!quiet) {
+    if (replace == second_chance_replace)
+      printf("Second change page replacement algorithm.\n");
+    else
+      printf("FIFO page replacement algorithm.\n");
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  run(file);
+
+  clock_gettime(CLOCK_MONOTONIC, &stop);
 
-  printf("%llu page faults\n", num_pagefault);
+  if (stats) {
+    /* program,policy,ram_pages,instructions,page_faults,writebacks,
+     * seconds,instr_per_sec */
+    seconds =
+        (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%s,%s,%d,%llu,%llu,%llu,%.6f,%.0f\n", file, policy_name, ram_pages,
+           num_instr, num_pagefault, num_writeback, seconds,
+           seconds > 0 ? num_instr / seconds : 0.0);
+  } else
+    printf("%llu page faults\n", num_pagefault);
 }
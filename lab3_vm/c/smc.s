@@ -0,0 +1,11 @@
+; Self modifying code: each iteration stores over the instruction at
+; TARGET before executing it. Used to check that the translator (--jit)
+; throws away code that was written to.
+        ld      2,0,patch       ; R2 = "addi 3,3,100"
+        addi    4,0,3
+loop:   st      2,0,target      ; overwrite the next instruction
+target: addi    3,3,1
+        subi    4,4,1
+        bt      0,4,loop
+        halt    0,0,0
+patch:  addi    3,3,100
@@ -0,0 +1,143 @@
+#include "rawdisk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Compares the raw disk backends on an image in /tmp.
+//
+// usage: disk-bench [disk_mb]
+//
+// Prints a CSV line per backend and workload:
+//   seq-read    the whole disk in 128 KiB readBlocks calls (FUSE's request
+//               size)
+//   seq-write   the same with writeBlocks, then syncDisk
+//   rand-read   single readBlock calls on random blocks
+//   rand-write  single writeBlock calls on random blocks, then syncDisk
+//   rand-peek   one word of a random block: readBlock with fd, a load
+//               through getBlockPtr with mmap
+// The image is in the page cache throughout, so this measures the cost of
+// the disk layer rather than of the storage.
+
+#define RUN_BLOCKS 256
+#define RAND_OPS 200000
+
+typedef struct {
+  char *name;
+  int backend;
+  int cache;
+} config;
+
+static config configs[] = {
+    {"fd", DISK_FD, 0},
+    {"fd-cache", DISK_FD, DISK_CACHE_BLOCKS},
+    {"mmap", DISK_MMAP, 0},
+};
+
+static char image[] = "/tmp/disk-bench-XXXXXX";
+static char run_buf[RUN_BLOCKS][BLOCK_SIZE];
+static void *run_ptrs[RUN_BLOCKS];
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void die(char *what) {
+  perror(what);
+  unlink(image);
+  exit(1);
+}
+
+static void report(config *c, char *workload, long ops, double t,
+                   long bytes) {
+  if (bytes > 0)
+    printf("%s,%s,%ld,%.1f,MB/s\n", c->name, workload, ops,
+           bytes / t / (1 << 20));
+  else
+    printf("%s,%s,%ld,%.1f,ns/op\n", c->name, workload, ops, t * 1e9 / ops);
+}
+
+static void run(config *c, int nblocks) {
+  char blk[BLOCK_SIZE];
+  long sum = 0;
+  double t;
+
+  if (setDiskBackend(c->backend) < 0 || setCacheSize(c->cache) < 0 ||
+      openDisk(image, nblocks * BLOCK_SIZE) < 0)
+    die(c->name);
+
+  t = now();
+  for (int b = 0; b < nblocks; b += RUN_BLOCKS)
+    if (writeBlocks(b, RUN_BLOCKS, run_ptrs) < 0)
+      die("writeBlocks");
+  if (syncDisk() < 0)
+    die("syncDisk");
+  report(c, "seq-write", nblocks / RUN_BLOCKS, now() - t,
+         (long)nblocks * BLOCK_SIZE);
+
+  t = now();
+  for (int b = 0; b < nblocks; b += RUN_BLOCKS)
+    if (readBlocks(b, RUN_BLOCKS, run_ptrs) < 0)
+      die("readBlocks");
+  report(c, "seq-read", nblocks / RUN_BLOCKS, now() - t,
+         (long)nblocks * BLOCK_SIZE);
+
+  srand(1);
+  t = now();
+  for (int i = 0; i < RAND_OPS; i++)
+    if (readBlock(rand() % nblocks, blk) < 0)
+      die("readBlock");
+  report(c, "rand-read", RAND_OPS, now() - t, 0);
+
+  memset(blk, 7, BLOCK_SIZE);
+  t = now();
+  for (int i = 0; i < RAND_OPS; i++)
+    if (writeBlock(rand() % nblocks, blk) < 0)
+      die("writeBlock");
+  if (syncDisk() < 0)
+    die("syncDisk");
+  report(c, "rand-write", RAND_OPS, now() - t, 0);
+
+  t = now();
+  for (int i = 0; i < RAND_OPS; i++) {
+    int b = rand() % nblocks;
+    long *p = getBlockPtr(b);
+    if (p == NULL) {
+      if (readBlock(b, blk) < 0)
+        die("readBlock");
+      p = (long *)blk;
+    }
+    sum += *p;
+  }
+  report(c, "rand-peek", RAND_OPS, now() - t, 0);
+
+  if (sum == 0) // keeps the loads
+    printf("# checksum 0\n");
+  if (closeDisk() < 0)
+    die("closeDisk");
+}
+
+int main(int argc, char *argv[]) {
+  int mb = argc > 1 ? atoi(argv[1]) : 64;
+  int nblocks = (mb << 20) / BLOCK_SIZE / RUN_BLOCKS * RUN_BLOCKS;
+
+  int fd = mkstemp(image);
+  if (fd < 0 || nblocks <= 0)
+    die(image);
+  close(fd);
+
+  for (int i = 0; i < RUN_BLOCKS; i++) {
+    memset(run_buf[i], i, BLOCK_SIZE);
+    run_ptrs[i] = run_buf[i];
+  }
+
+  printf("backend,workload,ops,value,unit\n");
+  for (int c = 0; c < sizeof configs / sizeof configs[0]; c++)
+    run(&configs[c], nblocks);
+
+  unlink(image);
+  return 0;
+}
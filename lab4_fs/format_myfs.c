@@ -12,17 +12,13 @@ int main(int argc, char *argv[]) {
   // first update the block map
   fs_block blk;
   // no need to read the block!
-  // readBlock(BLKMAP_BID, blk.blockmap);
-  // make sure all blocks are part of the free list, except block 1
+  // all blocks are free, except block 0 holding the map itself and block 1
   // which will have the directory entry
-  blk.blockmap[0] = 2;
-
-  for (unsigned short bid = 2; bid < FS_NBLOCKS; bid++) {
-    blk.blockmap[bid] = bid + 1;
-    printf("%u:%u ", bid, blk.blockmap[bid]);
-  }
-  blk.blockmap[FS_NBLOCKS - 1] = 0;
-  if (writeBlock(BLKMAP_BID, blk.blockmap) < 0) {
+  bzero(blk.bitmap, BLOCK_SIZE);
+  blk.bitmap[BLKMAP_BID / 8] |= 1 << BLKMAP_BID % 8;
+  blk.bitmap[ROOTDIR_BID / 8] |= 1 << ROOTDIR_BID % 8;
+  printf("%u blocks, %u free\n", FS_NBLOCKS, FS_NBLOCKS - 2);
+  if (writeBlock(BLKMAP_BID, blk.bitmap) < 0) {
     // some error occured
     perror("cannot write BLKMAP");
     return -1;
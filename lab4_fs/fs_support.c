@@ -1,7 +1,10 @@
 #include "fs_support.h"
 #include "rawdisk.h"
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 // caches for the directory and block map
 // FIXME: could be converted to a table or another structure holding more blocks
@@ -9,56 +12,261 @@
 fs_block bdir;
 fs_block bmap;
 
-// returns a block to the free blocks list. assumes that blocks[0] points to
-// the first free block. For simplicity, you can add blocks to the head of the
-// list. Note that the blocks structure must be written back to the disk.
-// This function returns the id of the old block pointed by the freed block
-// (which might point to the next block in a chain).
-unsigned short freeBlock(unsigned short *blocks, unsigned short freedId) {
-  unsigned short bid = blocks[freedId];
-  blocks[freedId] = blocks[0];
-  blocks[0] = freedId;
-  // FIXME: For security reasons, one might want to clear the freedId block on
-  // the disk (write 0s in it). You could do this here.
-  return bid;
-}
-
-// allocates a Block from the free list, if there are any. Returns either the
-// newly allocated block id, or -1 if there are none.
-unsigned short allocateBlock(unsigned short *blocks) {
-  unsigned short bid = blocks[0];
-  if (bid == 0) { // points back to itself, no more blocks
-    printf("allocateBlock: block 0 points to self! no free blocks\n");
+// The caches are read from the disk once and then stay resident. Changes only
+// set a dirty flag; sync_metadata writes the dirty blocks back.
+static int bdir_loaded, bmap_loaded;
+static int bdir_dirty, bmap_dirty;
+
+// serializes the file system operations with each other and with the flusher
+static pthread_mutex_t fs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// the flusher thread, writing back dirty metadata and cached blocks every
+// FLUSH_INTERVAL seconds
+static pthread_t flusher;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+static int flusher_running;
+
+// most extents a file can have: those in the entry and a full extent block
+#define MAX_EXTENTS (FS_EXTENTS + EXTENTS_PER_BLOCK)
+
+// loads the block map from the disk, the first time only. Returns NULL if
+// it cannot be read: the zeroed cache would show every block as free
+unsigned char *load_blockmap() {
+  if (!bmap_loaded) {
+    if (readBlock(BLKMAP_BID, bmap.bitmap) != BLOCK_SIZE)
+      return NULL;
+    bmap_loaded = 1;
+  }
+  return bmap.bitmap;
+}
+
+// sets or clears the bits of count blocks from start
+static void mark_blocks(unsigned short start, unsigned short count,
+                        int used) {
+  for (unsigned bid = start; bid < start + count; bid++)
+    if (used)
+      bmap.bitmap[bid / 8] |= 1 << bid % 8;
+    else
+      bmap.bitmap[bid / 8] &= ~(1 << bid % 8);
+  bmap_dirty = 1;
+}
+
+// number of free blocks from bid on, up to max
+static unsigned short free_run(unsigned bid, unsigned short max) {
+  unsigned short n = 0;
+  while (n < max && bid + n < FS_NBLOCKS &&
+         !block_is_used(bmap.bitmap, bid + n))
+    n++;
+  return n;
+}
+
+// finds the longest free run, its length in *len. EOF_BLOCK if none
+static unsigned short longest_run(unsigned short *len) {
+  unsigned short best = EOF_BLOCK;
+  *len = 0;
+  for (unsigned bid = 0; bid < FS_NBLOCKS;) {
+    unsigned short n = free_run(bid, FS_NBLOCKS);
+    if (n > *len) {
+      best = bid;
+      *len = n;
+    }
+    // skip the run and the used block ending it
+    bid += n + 1;
+  }
+  return best;
+}
+
+// allocates up to want consecutive blocks and returns the first one, with
+// the number allocated in got. Returns EOF_BLOCK if the disk is full or the
+// block map cannot be read.
+// The placement tries to keep files contiguous:
+// - a file grows in place when goal, the block after its last extent, is
+//   free;
+// - otherwise it continues at the first run of want blocks after goal;
+// - a new file (goal EOF_BLOCK) starts in the middle of the longest free
+//   run, leaving the first half for the file before it to grow into.
+// If no run is long enough, the longest one is used.
+unsigned short alloc_blocks(unsigned short goal, unsigned short want,
+                            unsigned short *got) {
+  unsigned char *map = load_blockmap();
+  unsigned short best = EOF_BLOCK;
+  unsigned short len = 0;
+
+  if (map == NULL) {
+    printf("alloc_blocks: cannot read the block map\n");
+    return EOF_BLOCK;
+  }
+  if (goal < FS_NBLOCKS && !block_is_used(map, goal)) {
+    best = goal;
+    len = free_run(goal, want);
+  } else if (goal < FS_NBLOCKS) {
+    for (unsigned i = 0; best == EOF_BLOCK && i < FS_NBLOCKS; i++) {
+      unsigned bid = (goal + i) % FS_NBLOCKS;
+      if (free_run(bid, want) == want) {
+        best = bid;
+        len = want;
+      }
+    }
+  } else {
+    best = longest_run(&len);
+    if (best != EOF_BLOCK && best > ROOTDIR_BID + 1 && len >= 2 * want) {
+      best += len / 2;
+      len -= len / 2;
+    }
+  }
+  if (best == EOF_BLOCK)
+    best = longest_run(&len);
+  if (best == EOF_BLOCK) {
+    printf("alloc_blocks: no free blocks\n");
     return EOF_BLOCK;
-  } else {                   // return the head of the list
-    blocks[0] = blocks[bid]; // the list starts with the next free block
-    blocks[bid] = EOF_BLOCK; // allocated block points nowere
-    return bid;
   }
+  if (len > want)
+    len = want;
+  mark_blocks(best, len, 1);
+  *got = len;
+  return best;
 }
 
-// loads the block map from the disk
-unsigned short *load_blockmap() {
-  readBlock(BLKMAP_BID, bmap.blockmap);
-  return bmap.blockmap;
+// returns count blocks from start to the free blocks. If the block map
+// cannot be read they stay used, on the disk and here.
+// FIXME: For security reasons, one might want to clear the freed blocks on
+// the disk (write 0s in them). You could do this here.
+void free_blocks(unsigned short start, unsigned short count) {
+  if (load_blockmap() == NULL)
+    return;
+  mark_blocks(start, count, 0);
+}
+
+// marks the block map as changed. it reaches the disk on the next sync
+void save_blockmap() { bmap_dirty = 1; }
+
+// bumped whenever extents are dropped, which makes all cursors stale
+static unsigned long extents_gen = 1;
+
+// makes de an empty file, with no extents
+void init_extents(dir_entry *de) {
+  memset(de->extents, 0, sizeof de->extents);
+  de->extent_block = EOF_BLOCK;
+  extents_gen++;
 }
 
-// allocates a new block using the loaded map. returns the id of the block
-unsigned short alloc_block() { return allocateBlock(bmap.blockmap); }
+// copies all the extents of the file into ext, returns how many are used
+static int load_extents(dir_entry *de, extent *ext) {
+  memcpy(ext, de->extents, sizeof de->extents);
+  memset(ext + FS_EXTENTS, 0, EXTENTS_PER_BLOCK * sizeof(extent));
+  if (de->extent_block != EOF_BLOCK &&
+      readBlock(de->extent_block, ext + FS_EXTENTS) != BLOCK_SIZE)
+    return -1;
+  int n = 0;
+  while (n < MAX_EXTENTS && ext[n].length)
+    n++;
+  return n;
+}
 
-// frees the given block in the loaded map. returns the block id the freed
-// block points to
-unsigned short free_block(unsigned short bid) {
-  return freeBlock(bmap.blockmap, bid);
+// stores back the extents of the file after load_extents changed them
+static int save_extents(dir_entry *de, extent *ext) {
+  memcpy(de->extents, ext, sizeof de->extents);
+  save_directory();
+  if (de->extent_block != EOF_BLOCK &&
+      writeBlock(de->extent_block, ext + FS_EXTENTS) != BLOCK_SIZE)
+    return -1;
+  return 0;
 }
 
-// saves the block map back on the disk
-void save_blockmap() { writeBlock(BLKMAP_BID, bmap.blockmap); }
+// adds want blocks at the end of the file, growing its last extent when the
+// blocks after it are free. n is the number of extents in ext. Returns 0, or
+// -1 if the disk or the extent list is full.
+static int grow_extents(dir_entry *de, extent *ext, int *n, unsigned want) {
+  while (want > 0) {
+    extent *last = *n > 0 ? &ext[*n - 1] : NULL;
+    unsigned short goal = last ? last->start + last->length : EOF_BLOCK;
+    unsigned short got;
+    unsigned short start = alloc_blocks(goal, want, &got);
+    if (start == EOF_BLOCK)
+      return -1;
+    if (last && start == goal) {
+      last->length += got;
+    } else {
+      if (*n == MAX_EXTENTS) {
+        free_blocks(start, got);
+        return -1;
+      }
+      if (*n == FS_EXTENTS && de->extent_block == EOF_BLOCK) {
+        // the entry is full, move on to an extent block. It goes in the
+        // first free block, where it splits no long run
+        unsigned short one;
+        de->extent_block = alloc_blocks(BLKMAP_BID, 1, &one);
+        if (de->extent_block == EOF_BLOCK) {
+          free_blocks(start, got);
+          return -1;
+        }
+      }
+      ext[*n].start = start;
+      ext[*n].length = got;
+      (*n)++;
+    }
+    want -= got;
+  }
+  return 0;
+}
 
-// loads the directory data structure from the disk
+// maps the logical blocks lblk .. lblk+count-1 of the file to disk blocks,
+// stored in phys. Finding a block costs a step per extent rather than per
+// block. With alloc set, missing blocks are allocated at the end of the
+// file, and the result is count or -1 if the disk is full. Without it, the
+// result is the number of blocks mapped before the file's blocks end.
+// cur, if not NULL, is the cursor of an open file, used and updated.
+int file_blocks(dir_entry *de, unsigned lblk, unsigned count,
+                unsigned short *phys, int alloc, file_cursor *cur) {
+  extent ext[MAX_EXTENTS];
+  int n = load_extents(de, ext);
+  if (n < 0)
+    return -1;
+
+  if (alloc) {
+    unsigned have = 0;
+    for (int i = 0; i < n; i++)
+      have += ext[i].length;
+    if (lblk + count > have) {
+      // keep what was allocated even if the disk fills up half way
+      int res = grow_extents(de, ext, &n, lblk + count - have);
+      if (save_extents(de, ext) < 0 || res < 0)
+        return -1;
+    }
+  }
+
+  int i = 0;         // extent being mapped
+  unsigned pos = 0;  // logical block where extent i starts
+  if (cur && cur->gen == extents_gen && cur->ext < n && cur->lblk <= lblk) {
+    i = cur->ext;
+    pos = cur->lblk;
+  }
+  unsigned done = 0; // blocks mapped so far
+  for (; i < n && done < count; i++) {
+    unsigned end = pos + ext[i].length;
+    for (; done < count && lblk + done < end; done++)
+      phys[done] = ext[i].start + (lblk + done - pos);
+    if (done == count)
+      break;
+    pos = end;
+  }
+  if (cur && i < n) {
+    cur->gen = extents_gen;
+    cur->ext = i;
+    cur->lblk = pos;
+  }
+  return done;
+}
+
+// loads the directory data structure from the disk, the first time only
 int load_directory() {
   // is a flat structure - one block directory at ROOTDIR_BID
-  return readBlock(ROOTDIR_BID, bdir.bytes);
+  if (!bdir_loaded) {
+    if (readBlock(ROOTDIR_BID, bdir.bytes) != BLOCK_SIZE)
+      return -1;
+    bdir_loaded = 1;
+  }
+  return BLOCK_SIZE;
 }
 
 // this function finds the directory block containing the entry for the given
@@ -103,5 +311,75 @@ int first_empty_dir_entry() {
 // assuming the latest block is a directory, it returns a pointer to entry i
 dir_entry *index2dir_entry(unsigned short i) { return &bdir.directory[i]; }
 
-// writes latest block to disk - something changed it in the memory
-void save_directory() { writeBlock(ROOTDIR_BID, bdir.bytes); }
+// marks the directory as changed - something changed it in the memory. it
+// reaches the disk on the next sync
+void save_directory() { bdir_dirty = 1; }
+
+// writes the dirty metadata blocks back to the disk. A block that fails to
+// write stays dirty. returns 0, or -1 if anything failed
+int sync_metadata() {
+  int res = 0;
+
+  if (bmap_dirty) {
+    if (writeBlock(BLKMAP_BID, bmap.bitmap) == BLOCK_SIZE)
+      bmap_dirty = 0;
+    else
+      res = -1;
+  }
+  if (bdir_dirty) {
+    if (writeBlock(ROOTDIR_BID, bdir.bytes) == BLOCK_SIZE)
+      bdir_dirty = 0;
+    else
+      res = -1;
+  }
+  return res;
+}
+
+void lock_fs() { pthread_mutex_lock(&fs_mutex); }
+
+void unlock_fs() { pthread_mutex_unlock(&fs_mutex); }
+
+// body of the flusher thread. sleeps on the condition so that stop_flusher
+// can wake it up early
+static void *flusher_loop(void *arg) {
+  struct timespec deadline;
+
+  lock_fs();
+  while (flusher_running) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += FLUSH_INTERVAL;
+    if (pthread_cond_timedwait(&flusher_cond, &fs_mutex, &deadline) ==
+        ETIMEDOUT) {
+      // the metadata goes through the buffer cache, then everything is
+      // forced out to the disk file
+      sync_metadata();
+      syncDisk();
+    }
+  }
+  unlock_fs();
+  return NULL;
+}
+
+// starts writing back dirty metadata and cached blocks every FLUSH_INTERVAL
+// seconds
+int start_flusher() {
+  flusher_running = 1;
+  if (pthread_create(&flusher, NULL, flusher_loop, NULL) != 0) {
+    flusher_running = 0;
+    return -1;
+  }
+  return 0;
+}
+
+// stops the flusher thread, if running. does not sync by itself
+void stop_flusher() {
+  lock_fs();
+  if (!flusher_running) {
+    unlock_fs();
+    return;
+  }
+  flusher_running = 0;
+  pthread_cond_signal(&flusher_cond);
+  unlock_fs();
+  pthread_join(flusher, NULL);
+}
@@ -40,15 +40,25 @@ you like and have time to implement.
 Hint: you could cache your block list and use the memory copy to get faster
 access to your block sequences (without reloading them every time). Make sure
 you flush your modifications to the disk!!
+
+This implementation keeps track of the blocks with extents rather than a
+linked list. Block 0 is a bitmap of the used blocks. Each file is a list of
+extents (first block, number of blocks): the first FS_EXTENTS live in the
+directory entry, the rest in an extent block the entry points to. The
+allocator prefers to grow the last extent of a file in place, so a file
+written sequentially ends up in a few long contiguous ranges.
  **/
 
 #ifndef __FS_SUPPORT_H__
 #define __FS_SUPPORT_H__
 
 #define DISK_FILE "RAWDISK_SSFS"
-// number of blocks in the file system
+// number of blocks in the file system, at most one bit per block of the map.
+// ssfs-test builds with a larger disk
+#ifndef FS_NBLOCKS
 #define FS_NBLOCKS 10
-// block map block id
+#endif
+// block map (bitmap of used blocks) block id
 #define BLKMAP_BID 0
 // root directory block id
 #define ROOTDIR_BID 1
@@ -56,25 +66,42 @@ you flush your modifications to the disk!!
 #define FS_NAME_LEN 12
 // value meaning invalid or end of file block (no more blocks)
 #define EOF_BLOCK 0xFFFF
+// seconds between write backs of dirty metadata
+#define FLUSH_INTERVAL 5
+
+// extents kept in the directory entry itself
+#define FS_EXTENTS 4
+
+// a run of consecutive disk blocks. length 0 marks an unused slot, and all
+// the slots after it are unused too
+typedef struct {
+  unsigned short start;
+  unsigned short length;
+} extent;
 
 typedef struct {
   char name[FS_NAME_LEN];
   // ... some stats - say mode, owner, modtime
   mode_t mode;
   unsigned long size_bytes;
-  unsigned short first_block;
+  // the blocks of the file, in order
+  extent extents[FS_EXTENTS];
+  // block holding the extents after the first FS_EXTENTS, or EOF_BLOCK
+  unsigned short extent_block;
 } dir_entry;
 
 #define DIR_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(dir_entry))
-#define BLOCKIDS_PER_BLOCK (BLOCK_SIZE / sizeof(unsigned short))
+#define EXTENTS_PER_BLOCK (BLOCK_SIZE / sizeof(extent))
 
 typedef union fs_block_t {
-  char bytes[BLOCK_SIZE];                      // bytewise access
-  unsigned short blockmap[BLOCKIDS_PER_BLOCK]; // FAT16 like
-  // more possibilities... ?
+  char bytes[BLOCK_SIZE];                     // bytewise access
+  unsigned char bitmap[BLOCK_SIZE];           // bit set: block in use
+  extent extents[EXTENTS_PER_BLOCK];          // extent block of a file
   dir_entry directory[DIR_ENTRIES_PER_BLOCK];
 } fs_block;
 
+#define block_is_used(map, bid) ((map)[(bid) / 8] & (1 << (bid) % 8))
+
 // some helpers
 // Working with the directory
 #define dir_entry_is_empty(d) (d.name[0] == 0)
@@ -85,9 +112,36 @@ dir_entry *index2dir_entry(unsigned short);
 void save_directory();
 
 // Working with the block map
-unsigned short *load_blockmap();
-unsigned short alloc_block();
-unsigned short free_block(unsigned short bid);
+unsigned char *load_blockmap();
+unsigned short alloc_blocks(unsigned short goal, unsigned short want,
+                            unsigned short *got);
+void free_blocks(unsigned short start, unsigned short count);
 void save_blockmap();
 
+// Working with the blocks of a file
+
+// where the last file_blocks call on a file ended: the extent holding its
+// last block, and the logical block that extent starts at. The next call
+// starts from there when it is not going backwards, so sequential access
+// does not rescan the extent list. init_extents invalidates all cursors.
+typedef struct {
+  unsigned long gen; // extent generation the cursor belongs to, 0 if unset
+  int ext;
+  unsigned lblk;
+} file_cursor;
+
+void init_extents(dir_entry *de);
+int file_blocks(dir_entry *de, unsigned lblk, unsigned count,
+                unsigned short *phys, int alloc, file_cursor *cur);
+
+// The directory and block map stay cached once loaded; the save_ functions
+// only mark them dirty. Dirty metadata goes to the disk in sync_metadata,
+// called on fsync, on unmount and from the flusher thread.
+int sync_metadata();
+int start_flusher();
+void stop_flusher();
+// the caches are shared by all FUSE threads: hold the lock while using them
+void lock_fs();
+void unlock_fs();
+
 #endif // __FS_SUPPORT_H__
@@ -0,0 +1,48 @@
+/* The parts of the FUSE 2 API that ssfs.c uses, so that ssfs-test can build
+   ssfs.c without libfuse and call its operations directly. ssfs-test
+   provides fuse_main. */
+#ifndef __FUSE_STUB_H__
+#define __FUSE_STUB_H__
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+struct fuse_file_info {
+  int flags;
+  uint64_t fh;
+};
+
+struct fuse_conn_info {
+  unsigned max_write;
+};
+
+typedef int (*fuse_fill_dir_t)(void *buf, const char *name,
+                               const struct stat *stbuf, off_t off);
+
+struct fuse_operations {
+  int (*getattr)(const char *, struct stat *);
+  int (*readdir)(const char *, void *, fuse_fill_dir_t, off_t,
+                 struct fuse_file_info *);
+  int (*read)(const char *, char *, size_t, off_t, struct fuse_file_info *);
+  int (*write)(const char *, const char *, size_t, off_t,
+               struct fuse_file_info *);
+  void *(*init)(struct fuse_conn_info *);
+  void (*destroy)(void *);
+  int (*fsync)(const char *, int, struct fuse_file_info *);
+  int (*chown)(const char *, uid_t, gid_t);
+  int (*utimens)(const char *, const struct timespec tv[2]);
+  int (*chmod)(const char *, mode_t);
+  int (*truncate)(const char *, off_t);
+  int (*rename)(const char *, const char *);
+  int (*unlink)(const char *);
+  int (*create)(const char *, mode_t, struct fuse_file_info *);
+  int (*open)(const char *, struct fuse_file_info *);
+  int (*release)(const char *, struct fuse_file_info *);
+};
+
+int fuse_main(int argc, char *argv[], const struct fuse_operations *op,
+              void *user_data);
+
+#endif // __FUSE_STUB_H__
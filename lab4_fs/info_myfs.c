@@ -7,43 +7,56 @@
 // Could be made even more detailed, by marking accessible blocks - and
 // detecting the missing ones this way.
 
+// prints the extents of a file and returns the number of blocks they hold
+static unsigned short show_extents(extent *ext, int n) {
+  unsigned short blocks = 0;
+  for (int i = 0; i < n && ext[i].length; i++) {
+    printf("    extent %d: blocks %u-%u\n", i, ext[i].start,
+           ext[i].start + ext[i].length - 1);
+    blocks += ext[i].length;
+  }
+  return blocks;
+}
+
 int main(int argc, char *argv[]) {
   if (openDisk(DISK_FILE, BLOCK_SIZE * FS_NBLOCKS) < 0) {
     perror("open disk failure");
     return -1;
   }
 
-  // first display the block map
+  // first display the block map, one character per block
   fs_block blkmap;
-  readBlock(BLKMAP_BID, blkmap.blockmap);
-  // display list
+  readBlock(BLKMAP_BID, blkmap.bitmap);
+  unsigned short freeblks = 0;
   for (unsigned short i = 0; i < FS_NBLOCKS; i++) {
-    if (i % 10)
+    if (i && i % 64 == 0)
       printf("\n");
-    printf("%i:%u ", i, blkmap.blockmap[i]);
+    if (block_is_used(blkmap.bitmap, i)) {
+      printf("#");
+    } else {
+      printf(".");
+      freeblks++;
+    }
   }
   printf("\n");
+
   // let's get some statistics:
   unsigned short usedblks = 0;
-  unsigned short freeblks = 0;
-  unsigned short crtfb = blkmap.blockmap[0];
-  while (crtfb != 0) {
-    crtfb = blkmap.blockmap[crtfb];
-    freeblks++;
-  }
-
   fs_block blkdir;
   // display the directory
   readBlock(ROOTDIR_BID, blkdir.directory);
   for (unsigned short i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
-    if (!dir_entry_is_empty(blkdir.directory[i])) {
-      printf("%u -- %.20s starts:%u\n", i, blkdir.directory[i].name,
-             blkdir.directory[i].first_block);
+    dir_entry *de = &blkdir.directory[i];
+    if (!dir_entry_is_empty((*de))) {
+      printf("%u -- %.*s %lu bytes\n", i, FS_NAME_LEN, de->name,
+             de->size_bytes);
       // let's count the blocks used in this file
-      crtfb = blkdir.directory[i].first_block;
-      while (crtfb != EOF_BLOCK) {
-        crtfb = blkmap.blockmap[crtfb];
-        usedblks++;
+      usedblks += show_extents(de->extents, FS_EXTENTS);
+      if (de->extent_block != EOF_BLOCK) {
+        fs_block blkext;
+        printf("    extent block: %u\n", de->extent_block);
+        readBlock(de->extent_block, blkext.extents);
+        usedblks += 1 + show_extents(blkext.extents, EXTENTS_PER_BLOCK);
       }
     } else {
       printf("%u -- empty entry\n", i);
@@ -1,10 +1,154 @@
-
 #include "rawdisk.h"
 #include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 static int disk_fd = -1; /* file descriptor for the file emulating the disk */
 static int disk_bsize = -1; /* disk size in bytes */
+static int backend = DISK_FD;
+static char *disk_map; /* DISK_MMAP: the whole disk file, else NULL */
+
+/* The buffer cache: a fixed set of frames, found by block id through a
+   chained hash table, and kept in a list from most to least recently used.
+   Free frames have bid -1 and sit at the tail, so they are used first. */
+typedef struct {
+  int bid;    /* block held by the frame, -1 if free */
+  int dirty;  /* modified since read from or written to the disk file */
+  int prev;   /* LRU list neighbours, -1 at the ends */
+  int next;
+  int hnext;  /* next frame in the same hash bucket, -1 at the end */
+  char data[BLOCK_SIZE];
+} frame;
+
+static int nframes = DISK_CACHE_BLOCKS;
+static frame *frames;
+static int *buckets; /* first frame of each chain, -1 if empty */
+static int nbuckets; /* a power of two */
+static int lru_head = -1, lru_tail = -1;
+static disk_stats stats;
+
+static int hash(int bid) { return (bid * 2654435761u) & (nbuckets - 1); }
+
+static void lru_unlink(int f) {
+  if (frames[f].prev >= 0)
+    frames[frames[f].prev].next = frames[f].next;
+  else
+    lru_head = frames[f].next;
+  if (frames[f].next >= 0)
+    frames[frames[f].next].prev = frames[f].prev;
+  else
+    lru_tail = frames[f].prev;
+}
+
+static void lru_push_front(int f) {
+  frames[f].prev = -1;
+  frames[f].next = lru_head;
+  if (lru_head >= 0)
+    frames[lru_head].prev = f;
+  else
+    lru_tail = f;
+  lru_head = f;
+}
+
+static int lookup(int bid) {
+  int f = buckets[hash(bid)];
+  while (f >= 0 && frames[f].bid != bid)
+    f = frames[f].hnext;
+  return f;
+}
+
+static void hash_remove(int f) {
+  int *link = &buckets[hash(frames[f].bid)];
+  while (*link != f)
+    link = &frames[*link].hnext;
+  *link = frames[f].hnext;
+}
+
+static int write_back(int f) {
+  if (pwrite(disk_fd, frames[f].data, BLOCK_SIZE,
+             (off_t)BLOCK_SIZE * frames[f].bid) != BLOCK_SIZE)
+    return -1;
+  frames[f].dirty = 0;
+  stats.writebacks++;
+  return 0;
+}
+
+/* Takes the least recently used frame for block bid, writing back its old
+   contents if modified. The frame is returned empty and most recently used,
+   or -1 if the write back failed. */
+static int evict(int bid) {
+  int f = lru_tail;
+  if (frames[f].bid >= 0) {
+    if (frames[f].dirty && write_back(f) < 0)
+      return -1;
+    hash_remove(f);
+  }
+  frames[f].bid = bid;
+  frames[f].hnext = buckets[hash(bid)];
+  buckets[hash(bid)] = f;
+  lru_unlink(f);
+  lru_push_front(f);
+  return f;
+}
+
+/* Forgets the block held by frame f and moves it to the tail. */
+static void release(int f) {
+  hash_remove(f);
+  frames[f].bid = -1;
+  frames[f].dirty = 0;
+  lru_unlink(f);
+  frames[f].prev = lru_tail;
+  frames[f].next = -1;
+  if (lru_tail >= 0)
+    frames[lru_tail].next = f;
+  else
+    lru_head = f;
+  lru_tail = f;
+}
+
+static int init_cache() {
+  if (nframes == 0)
+    return 0;
+  for (nbuckets = 1; nbuckets < 2 * nframes; nbuckets *= 2)
+    ;
+  frames = malloc(nframes * sizeof(frame));
+  buckets = malloc(nbuckets * sizeof(int));
+  if (frames == NULL || buckets == NULL) {
+    free(frames);
+    free(buckets);
+    frames = NULL;
+    buckets = NULL;
+    return -1;
+  }
+  memset(buckets, -1, nbuckets * sizeof(int));
+  lru_head = lru_tail = -1;
+  for (int f = 0; f < nframes; f++) {
+    frames[f].bid = -1;
+    frames[f].dirty = 0;
+    frames[f].hnext = -1;
+    lru_push_front(f);
+  }
+  memset(&stats, 0, sizeof stats);
+  return 0;
+}
+
+int setDiskBackend(int b) {
+  if ((b != DISK_FD && b != DISK_MMAP) || disk_fd >= 0)
+    return -1;
+  backend = b;
+  return b;
+}
+
+int setCacheSize(int nblocks) {
+  if (nblocks < 0 || disk_fd >= 0)
+    return -1;
+  nframes = nblocks;
+  return nblocks;
+}
 
 /* Open filename file as the raw disk. File size fixed at nbytes.
    Creates a new one if it does not exist. */
@@ -13,14 +157,33 @@ int openDisk(char *filename, int nbytes) {
   disk_fd = open(filename, O_RDWR);
   if (disk_fd < 0) {
     /* file does not exist, create it */
-    disk_fd = open(filename, O_RDWR | O_CREAT);
-    if (disk_fd != -1) {
-      /* make sure the file is nbytes large. Just write garbage for now. */
-      disk_bsize = write(disk_fd, &disk_fd, nbytes);
+    disk_fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (disk_fd < 0)
+      return -1;
+  }
+  /* make sure the file is at least nbytes large. New space reads as 0 */
+  struct stat st;
+  if (fstat(disk_fd, &st) < 0 ||
+      (st.st_size < nbytes && ftruncate(disk_fd, nbytes) < 0)) {
+    close(disk_fd);
+    disk_fd = -1;
+    return -1;
+  }
+  disk_bsize = nbytes;
+  if (backend == DISK_MMAP) {
+    disk_map = mmap(NULL, nbytes, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd,
+                    0);
+    if (disk_map == MAP_FAILED) {
+      disk_map = NULL;
+      close(disk_fd);
+      disk_fd = -1;
+      return -1;
     }
-  } else {
-    /* file exists. let's assume is nbytes large */
-    disk_bsize = nbytes;
+    memset(&stats, 0, sizeof stats);
+  } else if (init_cache() < 0) {
+    close(disk_fd);
+    disk_fd = -1;
+    return -1;
   }
   return disk_bsize;
 }
@@ -28,19 +191,181 @@ int openDisk(char *filename, int nbytes) {
 /* Reads raw block blocknr from the open disk and
    puts the data in the given buffer. */
 int readBlock(int blocknr, void *block) {
-  if (lseek(disk_fd, BLOCK_SIZE * blocknr, SEEK_SET) >= 0)
-    return read(disk_fd, block, BLOCK_SIZE);
-  else
+  if (blocknr < 0 || (long)BLOCK_SIZE * blocknr >= disk_bsize)
     return -1;
+  if (disk_map != NULL) {
+    memcpy(block, disk_map + (long)BLOCK_SIZE * blocknr, BLOCK_SIZE);
+    return BLOCK_SIZE;
+  }
+  if (nframes == 0)
+    return pread(disk_fd, block, BLOCK_SIZE, (off_t)BLOCK_SIZE * blocknr);
+
+  int f = lookup(blocknr);
+  if (f >= 0) {
+    stats.hits++;
+    lru_unlink(f);
+    lru_push_front(f);
+  } else {
+    stats.misses++;
+    f = evict(blocknr);
+    if (f < 0)
+      return -1;
+    if (pread(disk_fd, frames[f].data, BLOCK_SIZE,
+              (off_t)BLOCK_SIZE * blocknr) != BLOCK_SIZE) {
+      release(f);
+      return -1;
+    }
+  }
+  memcpy(block, frames[f].data, BLOCK_SIZE);
+  return BLOCK_SIZE;
 }
 
 /* Writes the raw block blocknr from the given buffer to the open disk. */
 int writeBlock(int blocknr, void *block) {
-  if (lseek(disk_fd, BLOCK_SIZE * blocknr, SEEK_SET) >= 0)
-    return write(disk_fd, block, BLOCK_SIZE);
-  else
+  if (blocknr < 0 || (long)BLOCK_SIZE * blocknr >= disk_bsize)
+    return -1;
+  if (disk_map != NULL) {
+    memcpy(disk_map + (long)BLOCK_SIZE * blocknr, block, BLOCK_SIZE);
+    return BLOCK_SIZE;
+  }
+  if (nframes == 0)
+    return pwrite(disk_fd, block, BLOCK_SIZE, (off_t)BLOCK_SIZE * blocknr);
+
+  int f = lookup(blocknr);
+  if (f >= 0) {
+    stats.hits++;
+    lru_unlink(f);
+    lru_push_front(f);
+  } else {
+    /* the whole block is overwritten, no need to read it first */
+    stats.misses++;
+    f = evict(blocknr);
+    if (f < 0)
+      return -1;
+  }
+  memcpy(frames[f].data, block, BLOCK_SIZE);
+  frames[f].dirty = 1;
+  return BLOCK_SIZE;
+}
+
+/* Most iovecs one preadv or pwritev takes on Linux */
+#define MAX_IOV 1024
+
+/* Does one preadv or pwritev per MAX_IOV blocks, all or nothing. With the
+   disk mapped, copies each block instead. */
+static int vector_io(int blocknr, int count, void **blocks, int write) {
+  struct iovec iov[MAX_IOV];
+  if (disk_map != NULL) {
+    for (int i = 0; i < count; i++) {
+      char *blk = disk_map + (long)BLOCK_SIZE * (blocknr + i);
+      if (write)
+        memcpy(blk, blocks[i], BLOCK_SIZE);
+      else
+        memcpy(blocks[i], blk, BLOCK_SIZE);
+    }
+    return 0;
+  }
+  while (count > 0) {
+    int n = count < MAX_IOV ? count : MAX_IOV;
+    for (int i = 0; i < n; i++) {
+      iov[i].iov_base = blocks[i];
+      iov[i].iov_len = BLOCK_SIZE;
+    }
+    off_t pos = (off_t)BLOCK_SIZE * blocknr;
+    ssize_t done = write ? pwritev(disk_fd, iov, n, pos)
+                         : preadv(disk_fd, iov, n, pos);
+    if (done != (ssize_t)n * BLOCK_SIZE)
+      return -1;
+    blocknr += n;
+    blocks += n;
+    count -= n;
+  }
+  return 0;
+}
+
+static int check_range(int blocknr, int count) {
+  return blocknr >= 0 && count >= 0 &&
+         (long)BLOCK_SIZE * (blocknr + count) <= disk_bsize;
+}
+
+/* Reads consecutive blocks into separate buffers. Cached blocks are copied
+   from their frames, which may be newer than the disk file, and become the
+   most recently used. Every run of uncached blocks in between is one
+   vector_io, and counts as a miss per block. */
+int readBlocks(int blocknr, int count, void **blocks) {
+  if (!check_range(blocknr, count))
     return -1;
+  int run = 0; /* start of the current uncached run */
+  for (int i = 0; i <= count; i++) {
+    int f = i < count && frames != NULL ? lookup(blocknr + i) : -1;
+    if (i < count && f < 0)
+      continue;
+    if (i > run) {
+      if (vector_io(blocknr + run, i - run, blocks + run, 0) < 0)
+        return -1;
+      if (frames != NULL)
+        stats.misses += i - run;
+    }
+    run = i + 1;
+    if (f >= 0) {
+      stats.hits++;
+      lru_unlink(f);
+      lru_push_front(f);
+      memcpy(blocks[i], frames[f].data, BLOCK_SIZE);
+    }
+  }
+  return count * BLOCK_SIZE;
 }
 
+/* Writes consecutive blocks straight to the disk file. Any cached copy is
+   now stale, so it is dropped, dirty or not. */
+int writeBlocks(int blocknr, int count, void **blocks) {
+  if (!check_range(blocknr, count))
+    return -1;
+  for (int i = 0; i < count && frames != NULL; i++) {
+    int f = lookup(blocknr + i);
+    if (f >= 0)
+      release(f);
+  }
+  if (vector_io(blocknr, count, blocks, 1) < 0)
+    return -1;
+  return count * BLOCK_SIZE;
+}
+
+void *getBlockPtr(int blocknr) {
+  if (disk_map == NULL || blocknr < 0 ||
+      (long)BLOCK_SIZE * blocknr >= disk_bsize)
+    return NULL;
+  return disk_map + (long)BLOCK_SIZE * blocknr;
+}
+
+/* Writes back all modified blocks. A block that fails stays dirty. */
+int syncDisk() {
+  if (disk_map != NULL)
+    return msync(disk_map, disk_bsize, MS_SYNC);
+  int res = 0;
+  for (int f = 0; f < nframes && frames != NULL; f++)
+    if (frames[f].bid >= 0 && frames[f].dirty && write_back(f) < 0)
+      res = -1;
+  if (fdatasync(disk_fd) < 0)
+    res = -1;
+  return res;
+}
+
+void getDiskStats(disk_stats *st) { *st = stats; }
+
 /* Closes the disk file. Forces outstanding writes to disk. */
-int closeDisk() { return close(disk_fd); }
+int closeDisk() {
+  int res = syncDisk();
+  if (disk_map != NULL && munmap(disk_map, disk_bsize) < 0)
+    res = -1;
+  disk_map = NULL;
+  free(frames);
+  free(buckets);
+  frames = NULL;
+  buckets = NULL;
+  if (close(disk_fd) < 0)
+    res = -1;
+  disk_fd = -1;
+  return res;
+}
@@ -1,12 +1,25 @@
-
 #ifndef __RAWDISK_H__
 #define __RAWDISK_H__
 
 /* Let's set the block size to 512 bytes */
 #define BLOCK_SIZE 512
 
+/* Default number of blocks kept in the buffer cache */
+#define DISK_CACHE_BLOCKS 64
+
+/* Ways of accessing the file emulating the disk */
+#define DISK_FD 0   /* pread/pwrite on a descriptor, behind the buffer cache */
+#define DISK_MMAP 1 /* the whole file mapped shared, no buffer cache */
+
 /* All functions return -1 on failure, and various positive values on success */
 
+/* Sets the number of blocks the buffer cache holds. 0 turns the cache off,
+   and every read and write goes to the disk file. Call before openDisk. */
+int setCacheSize(int nblocks);
+
+/* Selects the backend used by the next openDisk. DISK_FD is the default. */
+int setDiskBackend(int backend);
+
 /* Open filename file as the raw disk. File size fixed at nbytes.
    Creates a new one if it does not exist. */
 int openDisk(char *filename, int nbytes);
@@ -15,10 +28,48 @@ int openDisk(char *filename, int nbytes);
    puts the data in the given buffer. */
 int readBlock(int blocknr, void *block);
 
-/* Writes the raw block blocknr from the given buffer to the open disk. */
+/* Writes the raw block blocknr from the given buffer to the open disk.
+   With the cache on, the block only reaches the disk file when it is
+   evicted or on syncDisk. */
 int writeBlock(int blocknr, void *block);
 
+/* Reads count consecutive blocks starting at blocknr. Block i goes to the
+   buffer blocks[i], so a request can mix pieces of the caller's buffer with
+   scratch blocks. Cached blocks count as hits and are moved to the front of
+   the LRU list; uncached runs are read with one preadv each, count as a
+   miss per block, and do not enter the cache. Returns count * BLOCK_SIZE. */
+int readBlocks(int blocknr, int count, void **blocks);
+
+/* Writes count consecutive blocks starting at blocknr from the buffers
+   blocks[i] with pwritev, around the cache. Cached copies of these blocks
+   are dropped. Returns count * BLOCK_SIZE. */
+int writeBlocks(int blocknr, int count, void **blocks);
+
+/* With DISK_MMAP, returns the address of block blocknr in the mapping:
+   reads and writes through it need no copy, and writes reach the disk file
+   on syncDisk. Returns NULL with DISK_FD, where callers use readBlock and
+   writeBlock instead. */
+void *getBlockPtr(int blocknr);
+
+/* Writes every modified cached block to the disk file and waits for the
+   file data to be stable. With DISK_MMAP, msyncs the mapping. */
+int syncDisk();
+
 /* Closes the disk file. Forces outstanding writes to disk. */
 int closeDisk();
 
+/* Buffer cache counters, since openDisk */
+typedef struct {
+  long hits;       /* blocks read or written through a cached block */
+  long misses;     /* blocks that needed a free or evicted frame, or that
+                      readBlocks read around the cache. writeBlocks is not
+                      counted */
+  long writebacks; /* modified blocks written to the disk file */
+} disk_stats;
+
+void getDiskStats(disk_stats *st);
+
+/* The cache is not locked: callers must not use the disk from two threads
+   at the same time. */
+
 #endif // __RAWDISK_H__
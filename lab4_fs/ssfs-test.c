@@ -0,0 +1,227 @@
+// Runs the file system operations of ssfs.c directly, without FUSE or a
+// mount point. ssfs.c is included with its main renamed; that main still
+// parses the options and opens the disk, then calls the fuse_main below,
+// which runs the tests. Build against the stub in fuse-stub/.
+//
+// usage: ssfs-test [--backend=fd|mmap] [--cache=N]
+//
+// Works on a freshly formatted disk in a temporary directory. The file
+// system's own messages are dropped; failures go to stderr. Prints "ok" and
+// exits 0 if every check passed.
+#define main ssfs_main
+#include "ssfs.c"
+#undef main
+
+static int failures;
+
+#define check(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "ssfs-test:%d: %s\n", __LINE__, #cond);                  \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+// size of path as getattr reports it
+static long file_size(const struct fuse_operations *op, const char *path) {
+  struct stat st;
+  memset(&st, 0, sizeof st);
+  return op->getattr(path, &st) == 0 ? st.st_size : -1;
+}
+
+// number of free blocks in the block map
+static int free_blocks_left() {
+  unsigned char *map = load_blockmap();
+  int n = 0;
+  for (unsigned bid = 0; map != NULL && bid < FS_NBLOCKS; bid++)
+    n += !block_is_used(map, bid);
+  return n;
+}
+
+// the directory entry of path
+static dir_entry *entry(const char *path) {
+  load_directory();
+  int di = find_dir_entry(&path[1]);
+  return di < 0 ? NULL : index2dir_entry(di);
+}
+
+// takes the block after the last extent of path, so that the file cannot
+// grow in place and its next block starts a new extent
+static void pin_next_block(const char *path) {
+  lock_fs();
+  dir_entry *de = entry(path);
+  int n = 0;
+  while (n < FS_EXTENTS && de->extents[n].length)
+    n++;
+  unsigned short next = de->extents[n - 1].start + de->extents[n - 1].length;
+  unsigned short got;
+  check(alloc_blocks(next, 1, &got) == next);
+  unlock_fs();
+}
+
+// writes, overwrites and reads back one file, through its handle and by
+// path, across block boundaries and past its end
+static void test_read_write(const struct fuse_operations *op) {
+  struct fuse_file_info fi = {0};
+  char data[2 * BLOCK_SIZE], out[3 * BLOCK_SIZE];
+  for (int i = 0; i < sizeof data; i++)
+    data[i] = 'a' + i % 26;
+
+  check(op->create("/a", S_IFREG | 0644, &fi) == 0);
+  check(op->write("/a", data, 5, 0, &fi) == 5);
+  check(op->read("/a", out, sizeof out, 0, &fi) == 5);
+  check(memcmp(out, data, 5) == 0);
+  check(file_size(op, "/a") == 5);
+
+  // past the end: the hole reads back as zeros
+  check(op->write("/a", data, 10, BLOCK_SIZE + 100, &fi) == 10);
+  check(file_size(op, "/a") == BLOCK_SIZE + 110);
+  memset(out, 1, sizeof out);
+  check(op->read("/a", out, sizeof out, 0, NULL) == BLOCK_SIZE + 110);
+  int zeros = 1;
+  for (int i = 5; i < BLOCK_SIZE + 100; i++)
+    zeros &= out[i] == 0;
+  check(zeros);
+  check(memcmp(out + BLOCK_SIZE + 100, data, 10) == 0);
+
+  // unaligned, over both blocks, then partial reads
+  check(op->write("/a", data, sizeof data - 7, 7, &fi) == sizeof data - 7);
+  check(file_size(op, "/a") == sizeof data);
+  check(op->read("/a", out, 300, 400, &fi) == 300);
+  check(memcmp(out, data + 393, 300) == 0);
+  check(op->read("/a", out, sizeof out, sizeof data - 16, NULL) == 16);
+  check(memcmp(out, data + sizeof data - 23, 16) == 0);
+  check(op->read("/a", out, 10, sizeof data, &fi) == 0);
+
+  check(op->fsync("/a", 0, &fi) == 0);
+  check(op->release("/a", &fi) == 0);
+}
+
+// appends to two files in turns, one of them through two handles, then
+// truncates that file and writes it again. The cursors the handles kept
+// from before the truncation must not be followed: every read, through a
+// handle or by path, returns what was written last. p1 is left on the
+// second extent of the old layout, which starts a block earlier than the
+// second extent of the new one
+static void test_handles(const struct fuse_operations *op) {
+  struct fuse_file_info p1 = {0}, p2 = {0}, q = {0}, bypath = {0};
+  char pdata[3 * BLOCK_SIZE], qdata[BLOCK_SIZE], out[3 * BLOCK_SIZE];
+  for (int i = 0; i < sizeof pdata; i++)
+    pdata[i] = 'A' + i % 26;
+  for (int i = 0; i < sizeof qdata; i++)
+    qdata[i] = '0' + i % 10;
+
+  check(op->create("/p", S_IFREG | 0644, &p1) == 0);
+  check(op->open("/p", &p2) == 0);
+  check(op->create("/q", S_IFREG | 0644, &q) == 0);
+  for (int i = 0; i < 8; i++) {
+    struct fuse_file_info *fi = i % 2 ? &p2 : &p1;
+    if (i == 4)
+      pin_next_block("/p");
+    check(op->write("/p", pdata + i * 128, 128, i * 128, fi) == 128);
+    check(op->write("/q", qdata + i * 64, 64, i * 64, &q) == 64);
+  }
+  // leave the cursor of p1 on the second extent
+  check(op->read("/p", out, 200, 600, &p1) == 200);
+  check(memcmp(out, pdata + 600, 200) == 0);
+  check(entry("/p")->extents[1].length == 1);
+
+  check(op->truncate("/p", 0) == 0);
+  check(file_size(op, "/p") == 0);
+  check(op->read("/p", out, sizeof out, 0, &p1) == 0);
+  check(op->read("/p", out, sizeof out, 0, &bypath) == 0);
+
+  // new data, on new blocks, through the other handle
+  for (int i = 0; i < sizeof pdata; i++)
+    pdata[i] = 'a' + i % 26;
+  for (int i = 0; i < 6; i++) {
+    if (i == 4)
+      pin_next_block("/p");
+    check(op->write("/p", pdata + i * 256, 256, i * 256, &p2) == 256);
+  }
+  check(entry("/p")->extents[0].length == 2);
+  check(entry("/p")->extents[1].length == 1);
+
+  check(op->read("/p", out, 200, 600, &p1) == 200);
+  check(memcmp(out, pdata + 600, 200) == 0);
+  check(op->read("/p", out, sizeof out, 0, &p1) == sizeof pdata);
+  check(memcmp(out, pdata, sizeof pdata) == 0);
+  check(op->read("/p", out, sizeof out, 0, &bypath) == sizeof pdata);
+  check(memcmp(out, pdata, sizeof pdata) == 0);
+  check(op->read("/q", out, sizeof out, 0, &q) == sizeof qdata);
+  check(memcmp(out, qdata, sizeof qdata) == 0);
+  check(op->read("/q", out, sizeof out, 0, &bypath) == sizeof qdata);
+  check(memcmp(out, qdata, sizeof qdata) == 0);
+
+  check(op->release("/p", &p1) == 0);
+  check(op->release("/p", &p2) == 0);
+  check(op->release("/q", &q) == 0);
+}
+
+// a write past the end that runs out of space once the gap is filled with
+// zeros fails as a whole: the file keeps its size
+static void test_enospc(const struct fuse_operations *op) {
+  struct fuse_file_info fi = {0};
+  char data[BLOCK_SIZE], out[BLOCK_SIZE];
+  memset(data, 'z', sizeof data);
+
+  check(op->create("/full", S_IFREG | 0644, &fi) == 0);
+  check(op->write("/full", data, 10, 0, &fi) == 10);
+  // the zeros take the remaining blocks, the data needs one more
+  lock_fs();
+  off_t end = (off_t)(free_blocks_left() + 1) * BLOCK_SIZE;
+  unlock_fs();
+  check(op->write("/full", data, sizeof data, end, &fi) == -ENOSPC);
+  check(file_size(op, "/full") == 10);
+  check(op->read("/full", out, sizeof out, 0, &fi) == 10);
+  check(memcmp(out, data, 10) == 0);
+  check(op->release("/full", &fi) == 0);
+}
+
+int fuse_main(int argc, char *argv[], const struct fuse_operations *op,
+              void *user_data) {
+  op->init(NULL);
+  test_read_write(op);
+  test_handles(op);
+  test_enospc(op);
+  op->destroy(NULL);
+  return failures > 0;
+}
+
+// writes an empty block map and directory, as format_myfs does
+static int format() {
+  fs_block blk;
+  if (openDisk(DISK_FILE, BLOCK_SIZE * FS_NBLOCKS) < 0)
+    return -1;
+  memset(blk.bitmap, 0, BLOCK_SIZE);
+  blk.bitmap[BLKMAP_BID / 8] |= 1 << BLKMAP_BID % 8;
+  blk.bitmap[ROOTDIR_BID / 8] |= 1 << ROOTDIR_BID % 8;
+  int res = writeBlock(BLKMAP_BID, blk.bitmap);
+  memset(blk.bytes, 0, BLOCK_SIZE);
+  if (writeBlock(ROOTDIR_BID, blk.bytes) < 0)
+    res = -1;
+  if (closeDisk() < 0)
+    res = -1;
+  return res < 0 ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+  char dir[] = "/tmp/ssfs-test-XXXXXX";
+  if (mkdtemp(dir) == NULL || chdir(dir) < 0) {
+    perror("ssfs-test: temporary directory");
+    return 1;
+  }
+  int res = format() < 0;
+  if (res)
+    perror("ssfs-test: format");
+  else {
+    freopen("/dev/null", "w", stdout);
+    res = ssfs_main(argc, argv);
+  }
+  unlink(DISK_FILE);
+  if (chdir("/") == 0)
+    rmdir(dir);
+  if (res == 0)
+    fprintf(stderr, "ok\n");
+  return res;
+}
@@ -19,6 +19,7 @@
 #include "rawdisk.h"
 #include <errno.h>
 #include <fuse.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,6 +29,31 @@
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// An open file. open and create find the directory entry once and keep the
+// handle in fi->fh until release, so reads and writes skip the lookup. The
+// size is read from the entry itself, which all handles of a file share.
+typedef struct {
+  int di;          // index of the directory entry
+  file_cursor cur; // where the last read or write ended
+} file_handle;
+
+// finds the directory entry of a read or write, with the lock held: from
+// the open file handle if there is one, else by path. *cur is set to the
+// handle's cursor, or NULL. Returns NULL if there is no such file.
+static dir_entry *lookup_file(const char *path, struct fuse_file_info *fi,
+                              file_cursor **cur) {
+  if (fi != NULL && fi->fh != 0) {
+    file_handle *fh = (file_handle *)(uintptr_t)fi->fh;
+    *cur = &fh->cur;
+    return index2dir_entry(fh->di);
+  }
+  *cur = NULL;
+  // skip the "/" in the begining
+  load_directory();
+  int di = find_dir_entry(&path[1]);
+  return di < 0 ? NULL : index2dir_entry(di);
+}
+
 // The attributes should come from the directory entry.
 // TODO: [DIR_ENTRY] add last "m"odification time to the entry and handle it
 // properly
@@ -73,6 +99,7 @@ static int do_getattr(const char *path, struct stat *st) {
     // skip the "/" in the begining
     const char *fn = &path[1];
     // load directory info
+    lock_fs();
     load_directory();
     int di = find_dir_entry(fn);
     if (di >= 0) {
@@ -80,7 +107,9 @@ static int do_getattr(const char *path, struct stat *st) {
       printf("  -- %d > %.*s\n", di, FS_NAME_LEN, de->name);
       st->st_size = de->size_bytes;
       st->st_mode = de->mode;
+      unlock_fs();
     } else {
+      unlock_fs();
       printf("  -- find_dir_entry cannot find %s\n", fn);
       // this could be a new file. let it through?
       return -ENOENT; // no such file or dir
@@ -103,22 +132,24 @@ static int do_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
       0) // If the user is trying to show the files/directories of the root
          // directory show the following
   {
-    // load root directory (block 0 is the block list, block 1 root dir)
-    fs_block rootb;
-    readBlock(ROOTDIR_BID, rootb.bytes);
+    // use the cached root directory, the disk copy may be behind it
+    lock_fs();
+    load_directory();
 
     // go through all entries and add them to the list with "filler"
     // note that the number of entries is limited to one block!
     // TODO: [LARGE_DIR] Extend the FS to allow directories larger than one
     // block Hint: linked block lists again
-    for (int i = 0;
-         i < DIR_ENTRIES_PER_BLOCK && !(dir_entry_is_empty(rootb.directory[i]));
-         i++) {
+    for (int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+      dir_entry *de = index2dir_entry(i);
+      if (dir_entry_is_empty((*de)))
+        break;
       char bnr[FS_NAME_LEN];
-      snprintf(bnr, FS_NAME_LEN, "%s", rootb.directory[i].name);
+      snprintf(bnr, FS_NAME_LEN, "%s", de->name);
       // printf("   > %d-%s\n",i,bnr);
       filler(buffer, bnr, NULL, 0);
     }
+    unlock_fs();
   } else {
     // it's a subdirectory. Should locate it and display its contents.
     return -1;
@@ -127,154 +158,268 @@ static int do_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
   return 0;
 }
 
-// Reads size bytes from the file path, from given offset (not yet!) and
-// puts them in the buffer.
-// TODO: [READ_OFFSET] get to the right offset (navigate the file blocks) to
-// read the size It works ok even if you read no more than one block at the time
-// but make sure you return the right number of bytes you read.
+// Moves the blocks phys[0..n-1] from or to the buffers bufs[0..n-1]. Each
+// run of physically consecutive blocks is a single readBlocks/writeBlocks
+// call, so a file laid out contiguously costs one vectored I/O.
+static int transfer_blocks(unsigned short *phys, char **bufs, unsigned n,
+                           int write) {
+  unsigned run = 0;
+  for (unsigned i = 1; i <= n; i++) {
+    if (i < n && phys[i] == phys[i - 1] + 1)
+      continue;
+    int res = write ? writeBlocks(phys[run], i - run, (void **)bufs + run)
+                    : readBlocks(phys[run], i - run, (void **)bufs + run);
+    if (res < 0)
+      return -1;
+    run = i;
+  }
+  return 0;
+}
+
+// Points bufs[i] at the part of buffer holding logical block first+i, for
+// the blocks the request [offset, offset+size) covers completely. The first
+// and last blocks may be covered partially: those get the scratch blocks
+// head and tail instead, and the function returns which ones did.
+#define HEAD_PARTIAL 1
+#define TAIL_PARTIAL 2
+static int map_buffer(char *buffer, size_t size, off_t offset, unsigned first,
+                      unsigned n, char **bufs, char *head, char *tail) {
+  int partial = 0;
+  for (unsigned i = 0; i < n; i++)
+    bufs[i] = buffer + ((off_t)(first + i) * BLOCK_SIZE - offset);
+  if (offset % BLOCK_SIZE || (n == 1 && size < BLOCK_SIZE)) {
+    bufs[0] = head;
+    partial |= HEAD_PARTIAL;
+  }
+  if ((offset + size) % BLOCK_SIZE && !(n == 1 && partial)) {
+    bufs[n - 1] = tail;
+    partial |= TAIL_PARTIAL;
+  }
+  return partial;
+}
+
+// With the disk mapped in memory, copies between the buffer and the blocks
+// phys[0..n-1] in place, partial blocks included: no scratch blocks and no
+// read before a partial write. Returns -1 with the fd backend, where the
+// caller has to go through readBlocks/writeBlocks.
+static int copy_mapped(unsigned short *phys, unsigned n, char *buffer,
+                       size_t size, off_t offset, int write) {
+  if (getBlockPtr(phys[0]) == NULL)
+    return -1;
+  size_t done = 0;
+  size_t byteoffs = offset % BLOCK_SIZE;
+  for (unsigned i = 0; i < n; i++) {
+    char *blk = (char *)getBlockPtr(phys[i]) + byteoffs;
+    size_t len = min(size - done, BLOCK_SIZE - byteoffs);
+    if (write)
+      memcpy(blk, buffer + done, len);
+    else
+      memcpy(buffer + done, blk, len);
+    done += len;
+    byteoffs = 0;
+  }
+  return 0;
+}
+
+// Reads size bytes from the file path, from given offset, and puts them in
+// the buffer. Blocks fully inside the request are read straight into the
+// buffer; only a partial first and last block go through scratch blocks.
 static int do_read(const char *path, char *buffer, size_t size, off_t offset,
                    struct fuse_file_info *fi) {
   printf("--> Trying to read %s, %ld, %zu\n", path, offset, size);
 
-  // skip the "/" in the begining
-  const char *fn = &path[1];
   // let's figure out the dir entry for the path
-  load_directory();
-  int di = find_dir_entry(fn);
-  if (di < 0) {
+  lock_fs();
+  file_cursor *cur;
+  dir_entry *de = lookup_file(path, fi, &cur);
+  if (de == NULL) {
     // no such file
+    unlock_fs();
     printf("    no such file\n");
     return -ENOENT;
   }
-  dir_entry *de = index2dir_entry(di);
-  unsigned bid = de->first_block;
-
-  char bcache[BLOCK_SIZE];
-  // ... //
-  // reads the block into the cache
-  readBlock(bid, bcache);
-  // cannot read all maybe?
-  size_t rsize = min(size, BLOCK_SIZE);
-  // ... //
 
-  // we now fill the buffer with this block contents
-  // TODO: [READ_OFFSET] account for the offset! May need to traverse the blocks
-  // of this file until the block holding the right offset. Have a look at
-  // do_write.
+  // cannot read past the end of the file
+  if (offset >= de->size_bytes) {
+    unlock_fs();
+    return 0;
+  }
+  size = min(size, de->size_bytes - offset);
+
+  // the logical blocks covered by the request
+  unsigned first = offset / BLOCK_SIZE;
+  unsigned n = (offset + size - 1) / BLOCK_SIZE - first + 1;
+  unsigned short phys[n];
+  char *bufs[n];
+  char head[BLOCK_SIZE], tail[BLOCK_SIZE];
+
+  if (file_blocks(de, first, n, phys, 0, cur) != n) {
+    unlock_fs();
+    printf("    block chain shorter than the file!\n");
+    return -EIO;
+  }
+  if (copy_mapped(phys, n, buffer, size, offset, 0) == 0) {
+    unlock_fs();
+    return size;
+  }
+  int partial = map_buffer(buffer, size, offset, first, n, bufs, head, tail);
+  // still under the lock: the buffer cache is shared between threads
+  if (transfer_blocks(phys, bufs, n, 0) < 0) {
+    unlock_fs();
+    return -EIO;
+  }
+  unlock_fs();
 
-  memcpy(buffer, bcache, rsize);
+  // copy out the parts of the partial blocks that were asked for
+  size_t byteoffs = offset % BLOCK_SIZE;
+  if (partial & HEAD_PARTIAL)
+    memcpy(buffer, head + byteoffs, min(size, BLOCK_SIZE - byteoffs));
+  if (partial & TAIL_PARTIAL)
+    memcpy(buffer + size - (offset + size) % BLOCK_SIZE, tail,
+           (offset + size) % BLOCK_SIZE);
 
   // how much did we read?
-  return rsize;
+  return size;
 }
 
-// Writes buffer to file, at given offset. Should extend the file if necessary
-// which could mean allocating blocks. Expects to write the full size.
-// TODO: [LARGE_WRITE] As is, it does not allow for writes extending over
-// several blocks. fix that.
-static int do_write(const char *path, const char *buffer, size_t size,
-                    off_t offset, struct fuse_file_info *fi) {
-  printf("--> Trying to write %s, %ld, %zu\n", path, offset, size);
+// Fills a partial block before it is written back: with the current
+// contents if the block held file data, with zeros if it was just added.
+static int fill_partial(char *blk, unsigned short bid, unsigned lblk,
+                        unsigned long old_size) {
+  if ((unsigned long)lblk * BLOCK_SIZE < old_size)
+    return readBlock(bid, blk) == BLOCK_SIZE ? 0 : -1;
+  memset(blk, 0, BLOCK_SIZE);
+  return 0;
+}
 
-  // let's figure out the dir entry
-  // skip the "/" in the begining
-  const char *fn = &path[1];
-  // let's figure out the dir entry for the path
-  load_directory();
-  int di = find_dir_entry(fn);
-  if (di < 0) { // no such file
-    printf("    no such file\n");
-    return -ENOENT;
+// Writes size bytes of buffer at offset into the file of de, with the lock
+// held. Allocates all the new blocks first, then writes the whole range.
+// Only a partial first and last block are read and patched in scratch
+// blocks; the rest is written straight from the buffer. Returns size or a
+// negative error.
+static int write_range(dir_entry *de, file_cursor *cur, const char *buffer,
+                       size_t size, off_t offset) {
+  // the logical blocks covered by the request
+  unsigned first = offset / BLOCK_SIZE;
+  unsigned n = (offset + size - 1) / BLOCK_SIZE - first + 1;
+  unsigned short phys[n];
+  char *bufs[n];
+  char head[BLOCK_SIZE], tail[BLOCK_SIZE];
+
+  // map the blocks, growing the chain if the file needs to grow
+  int res = file_blocks(de, first, n, phys, 1, cur);
+  if (res < 0) {
+    printf("   out of free blocks!\n");
+    return -ENOSPC;
   }
-  dir_entry *de = index2dir_entry(di);
 
-  // load the block map
-  unsigned short *bmap = load_blockmap();
+  // FUSE does not modify the buffer, the casts only fit the read path
+  if (copy_mapped(phys, n, (char *)buffer, size, offset, 1) < 0) {
+    int partial =
+        map_buffer((char *)buffer, size, offset, first, n, bufs, head, tail);
+    size_t byteoffs = offset % BLOCK_SIZE;
+    if (partial & HEAD_PARTIAL) {
+      if (fill_partial(head, phys[0], first, de->size_bytes) < 0)
+        return -EIO;
+      memcpy(head + byteoffs, buffer, min(size, BLOCK_SIZE - byteoffs));
+    }
+    if (partial & TAIL_PARTIAL) {
+      if (fill_partial(tail, phys[n - 1], first + n - 1, de->size_bytes) < 0)
+        return -EIO;
+      memcpy(tail, buffer + size - (offset + size) % BLOCK_SIZE,
+             (offset + size) % BLOCK_SIZE);
+    }
+    if (transfer_blocks(phys, bufs, n, 1) < 0)
+      return -EIO;
+  }
 
   // do we need to extend the file size?
   if (offset + size > de->size_bytes) {
-    // file needs to grow
-    printf("   file needs to grow by %lu bytes\n",
-           offset + size - de->size_bytes);
-    // allocate blocks and write it
-    if (de->first_block == EOF_BLOCK) {
-      // this is an empty file! start by allocating a new block
-      de->first_block = alloc_block();
-      if (de->first_block == EOF_BLOCK) {
-        printf("   no more free blocks!\n");
-        return -ENOSPC;
-      }
-    }
-    // update the size of the file
     de->size_bytes = offset + size;
-
-    // flush back the directory, since the file info changed
+    // mark the directory dirty, since the file info changed
     save_directory();
   }
-  // first figure out where the write starts (offset in blocks)
-  unsigned short blkoffs = offset / BLOCK_SIZE;
-  // offset within that block
-  unsigned short byteoffs = offset % BLOCK_SIZE;
-  // how many bytes to write in this block
-  unsigned short crtsize = min(size, BLOCK_SIZE - byteoffs);
-
-  // Depending on how the blocks in a files are organized, blkoffs needs to
-  // be mapped to a physical disk block. 3rd block in a contiguous mapped file
-  // means the third block in line from the first block. For a file allocated
-  // as a linked list of blocks, this is something like this:
-  unsigned short crtblk = de->first_block;
-  // navigate to the proper block
-  while (blkoffs) {
-    // not yet in the right block.
-    if (bmap[crtblk] != EOF_BLOCK) {
-      // follow the link
-      crtblk = bmap[crtblk];
-    } else {
-      // past the ends of the blocks, need to allocate a new one
-      unsigned short nblk = alloc_block();
-      if (nblk == EOF_BLOCK) {
-        // cannot allocate more, failed
-        printf("   out of free blocks!\n");
-        return -ENOSPC;
-      }
-      // add the new block to the list
-      bmap[crtblk] = nblk;
-      // advance to it
-      crtblk = nblk;
-    }
-    blkoffs--;
-  }
-  // here crtblk should point to the right block
-  printf(" --: start writing at block %u", crtblk);
-
-  char bcache[BLOCK_SIZE];
-  // reads the block into the cache
-  readBlock(crtblk, bcache);
-  // modifies it by writing some bytes from the buffer
-  // TODO: [LARGE_WRITE] this only writes one block! needs to be modified to
-  // write all, if there are more than 1. Consider a while loop around this.
-  // Consider also allocating all new blocks from the start, and then come
-  // back to write them.
-  memcpy(bcache + byteoffs, buffer, crtsize);
-  // write it back
-  writeBlock(crtblk, bcache);
-
-  // ... //
-  // make sure to update the blockl map
-  save_blockmap();
-
-  // how much did we write? lie here to get this running for one block
-  // TODO: [LARGE_WRITE] must make sure to write the full size bytes, which
-  // might mean several blocks
   return size;
 }
 
+// Writes buffer to file, at given offset. Extends the file if necessary. A
+// write past the end first fills the gap with zeros, so that the hole reads
+// back as zeros rather than whatever the new blocks held. If the write
+// fails, the file keeps its old size.
+static int do_write(const char *path, const char *buffer, size_t size,
+                    off_t offset, struct fuse_file_info *fi) {
+  static const char zeros[16 * BLOCK_SIZE];
+  printf("--> Trying to write %s, %ld, %zu\n", path, offset, size);
+
+  if (size == 0)
+    return 0;
+
+  // let's figure out the dir entry for the path. The directory and the block
+  // map are cached, so this costs no disk I/O after the first call
+  lock_fs();
+  file_cursor *cur;
+  dir_entry *de = lookup_file(path, fi, &cur);
+  if (de == NULL) { // no such file
+    unlock_fs();
+    printf("    no such file\n");
+    return -ENOENT;
+  }
+
+  int res = 0;
+  unsigned long old_size = de->size_bytes;
+  while (res >= 0 && de->size_bytes < offset)
+    res = write_range(de, cur, zeros,
+                      min(sizeof zeros, offset - de->size_bytes),
+                      de->size_bytes);
+  if (res >= 0)
+    res = write_range(de, cur, buffer, size, offset);
+  // none of buffer was written, so the zeros in front of it go too. The
+  // blocks they took stay with the file
+  if (res < 0 && de->size_bytes != old_size) {
+    de->size_bytes = old_size;
+    save_directory();
+  }
+  unlock_fs();
+  return res;
+}
+
+// Called when the FS is mounted, after fuse_main has daemonized. Starts the
+// thread writing back dirty metadata.
+static void *do_init(struct fuse_conn_info *conn) {
+  if (start_flusher() < 0)
+    printf("--> cannot start the flusher, metadata is written on sync only\n");
+  return NULL;
+}
+
 // Called when the FS is dismounted
 static void do_destroy(void *priv_data) {
-  closeDisk();
+  stop_flusher();
+  lock_fs();
+  if (sync_metadata() < 0)
+    printf("--> could not write back the metadata!\n");
+  unlock_fs();
+  disk_stats ds;
+  getDiskStats(&ds);
+  printf("--> buffer cache: %ld hits, %ld misses, %ld writebacks\n", ds.hits,
+         ds.misses, ds.writebacks);
+  if (closeDisk() < 0)
+    printf("--> could not flush the disk!\n");
   printf("--> FS closed.\n");
 }
 
+// Writes back the cached metadata, then flushes the buffer cache, which
+// holds both the metadata and the file data blocks.
+static int do_fsync(const char *path, int datasync,
+                    struct fuse_file_info *fi) {
+  printf("--> Trying to fsync %s\n", path);
+  lock_fs();
+  int res = sync_metadata();
+  if (syncDisk() < 0)
+    res = -1;
+  unlock_fs();
+  return res < 0 ? -EIO : 0;
+}
+
 // needed for "cp" and creating new files
 static int do_chmod(const char *path, mode_t mo) {
   printf("--> Trying to chmod %s, %hu\n", path, mo);
@@ -302,10 +447,12 @@ static int do_truncate(const char *path, off_t offset) {
   // skip the "/" in the begining
   const char *fn = &path[1];
   // let's figure out the dir entry for the path
+  lock_fs();
   load_directory();
   int di = find_dir_entry(fn);
   if (di < 0) {
     // no such file - do nothing?!
+    unlock_fs();
     return -ENOENT;
   } else {
     // file found! must alter both the Directory
@@ -316,18 +463,16 @@ static int do_truncate(const char *path, off_t offset) {
     de->size_bytes = 0;
 
     // TODO: [TRUNC_FREE] also free the blocks of this file!
-    // load block map
-    // while(de->first_block != EOF_BLOCK) {
-    // freeBlock()
-    //	de->first_block = bmap.blockmap[de->first_block];
-    // }
+    // for each extent in de->extents (and in de->extent_block, if any)
+    //   free_blocks(start, length)
     // save block map
 
     // for now just cut loose all blocks! block leak!
-    de->first_block = EOF_BLOCK;
+    init_extents(de);
     // must save directory changes to disk!
     save_directory();
   }
+  unlock_fs();
   return 0;
 }
 
@@ -350,15 +495,28 @@ static int do_mknod(const char *path, mode_t m, dev_t dv) {
 }
 */
 
+// allocates the handle of an open file for directory entry di
+static int new_handle(int di, struct fuse_file_info *ffi) {
+  file_handle *fh = malloc(sizeof(file_handle));
+  if (fh == NULL)
+    return -ENOMEM;
+  fh->di = di;
+  memset(&fh->cur, 0, sizeof fh->cur);
+  ffi->fh = (uintptr_t)fh;
+  return 0;
+}
+
 static int do_create(const char *path, mode_t m, struct fuse_file_info *ffi) {
   printf("XXXX> Trying to create %s mode:%u\n", path, m);
 
   // locate file
   // skip the "/" in the begining
   const char *fn = &path[1];
+  lock_fs();
   load_directory();
   int ni = first_empty_dir_entry();
   if (ni < 0) { // cannot do anything
+    unlock_fs();
     printf("  > no empty entries\n");
     return -ENFILE;
   }
@@ -368,19 +526,36 @@ static int do_create(const char *path, mode_t m, struct fuse_file_info *ffi) {
   strncpy(de->name, fn, FS_NAME_LEN);
   de->mode = m; // S_IFREG | 0644;
   de->size_bytes = 0;
-  de->first_block = EOF_BLOCK; // end of file block
+  init_extents(de); // no blocks yet
 
   // must save directory changes to disk!
   save_directory();
+  // the new file is open, as after do_open
+  int res = new_handle(ni, ffi);
+  unlock_fs();
 
-  return 0;
+  return res;
 }
-/*
+
+// Finds the file once and keeps its handle for the reads and writes.
 static int do_open(const char *path, struct fuse_file_info *ffi) {
   printf("ZZZZ> Trying to open %s \n", path);
-  return -1;
+  lock_fs();
+  load_directory();
+  int di = find_dir_entry(&path[1]);
+  int res = di < 0 ? -ENOENT : new_handle(di, ffi);
+  unlock_fs();
+  return res;
 }
 
+// Called once the last descriptor of an open file is closed.
+static int do_release(const char *path, struct fuse_file_info *ffi) {
+  free((file_handle *)(uintptr_t)ffi->fh);
+  ffi->fh = 0;
+  return 0;
+}
+
+/*
 static int do_access(const char *path, int ai) {
   printf("--> Trying to access %s %d\n", path, ai);
   return -1;
@@ -391,7 +566,9 @@ static struct fuse_operations operations = {
     .getattr = do_getattr,
     .readdir = do_readdir,
     .read = do_read,
+    .init = do_init,
     .destroy = do_destroy,
+    .fsync = do_fsync,
     .write = do_write,
     // just monitoring these for now
     .chown = do_chown,
@@ -405,13 +582,45 @@ static struct fuse_operations operations = {
     .unlink = do_unlink, // implements remove
                          //  .mknod = do_mknod,
     .create = do_create,
-    //  .open = do_open,
+    .open = do_open,
+    .release = do_release,
     //  .access = do_access,
 };
 
+// Takes the options of this file system out of argv, leaving the rest for
+// fuse_main:
+//   --backend=fd|mmap  how the disk file is accessed (default fd)
+//   --cache=N          blocks in the buffer cache of the fd backend
+static int parse_options(int *argc, char *argv[]) {
+  int n = 1;
+  for (int i = 1; i < *argc; i++) {
+    if (strcmp(argv[i], "--backend=fd") == 0)
+      setDiskBackend(DISK_FD);
+    else if (strcmp(argv[i], "--backend=mmap") == 0)
+      setDiskBackend(DISK_MMAP);
+    else if (strncmp(argv[i], "--cache=", 8) == 0) {
+      if (setCacheSize(atoi(argv[i] + 8)) < 0)
+        return -1;
+    } else if (strncmp(argv[i], "--backend=", 10) == 0)
+      return -1;
+    else
+      argv[n++] = argv[i];
+  }
+  *argc = n;
+  argv[n] = NULL;
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
+  if (parse_options(&argc, argv) < 0) {
+    fprintf(stderr, "usage: %s [--backend=fd|mmap] [--cache=N] "
+                    "[FUSE options] mountpoint\n",
+            argv[0]);
+    return 1;
+  }
   if (openDisk(DISK_FILE, BLOCK_SIZE * FS_NBLOCKS) < 0) {
     perror("open disk failure");
-  } else
-    return fuse_main(argc, argv, &operations, NULL);
+    return 1;
+  }
+  return fuse_main(argc, argv, &operations, NULL);
 }